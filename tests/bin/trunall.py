@@ -6,6 +6,9 @@ execute('python3 $PCOMP_DEVROOT/tests/bin/tasm.py')
 execute('python3 $PCOMP_DEVROOT/tests/bin/tdisasm.py')
 execute('python3 $PCOMP_DEVROOT/tests/bin/tasmroundtrip.py')
 execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e INTERPRETER')
+execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/int -e INTERPRETER')
+execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e INTERPRETER -f 64')
+execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/int -e INTERPRETER -f 64')
 
 match machine():
     case 'arm64' | 'aarch64':
@@ -16,5 +19,15 @@ match machine():
         execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e INTERPRETER')
         execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e x86_64JIT')
         execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e x86_64JIT')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e x86_64JIT -j 4')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e x86_64JIT -j 4')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e x86_64JIT -l')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e x86_64JIT -l')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e TIERED')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/vm -e TIERED')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e x86_64JIT -c')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e TIERED -c')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e INTERPRETER -f 64')
+        execute('python3 $PCOMP_DEVROOT/tests/bin/tvm.py -r tests/data/jit -e x86_64JIT -f 64')
     case _:
         pass
@@ -1,4 +1,5 @@
 import argparse
+import os
 
 from typing import List
 
@@ -11,19 +12,36 @@ def parse_args() -> argparse.Namespace:
                         required=False, default='tests/data/vm', \
                         help='root directory for in/*.asm and ref/*.stdout')
     parser.add_argument('-e', '--execution-type', metavar='EXEC_TYPE', dest='exec_type',
-                        required=False, choices=['INTERPRETER', 'AArch64JIT', 'x86_64JIT'], default='INTERPRETER',
+                        required=False, choices=['INTERPRETER', 'AArch64JIT', 'x86_64JIT', 'TIERED'], default='INTERPRETER',
                         help='''the execution type; defaults to INTERPRETER;
-                                possible values: INTERPRETER, AArch64JIT, x86_64JIT''')
+                                possible values: INTERPRETER, AArch64JIT, x86_64JIT, TIERED''')
+    parser.add_argument('-l', '--lazy', dest='lazy',
+                        required=False, action='store_true',
+                        help='JIT code on first entry')
+    parser.add_argument('-j', '--jit-threads', metavar='N', type=int, dest='jit_threads',
+                        required=False, default=0,
+                        help='JIT on N threads')
+    parser.add_argument('-c', '--jit-cache', dest='jit_cache',
+                        required=False, action='store_true',
+                        help='run each test twice through a fresh JIT code cache, filling it and then loading from it')
+    parser.add_argument('-f', '--fuel', metavar='FUEL', type=int, dest='fuel',
+                        required=False, default=0,
+                        help='run each test in slices of FUEL units of fuel')
     return parser.parse_args()
 
 
-def execute_test(name: str, exec_type: str, in_asm: str, ref_stdout: str, out_hex: str, out_stdout: str):
+def execute_test(name: str, exec_type: str, vm_opts: str, in_asm: str, ref_stdout: str, ref_status: str, out_hex: str, out_stdout: str):
     print(f"{name}...", end='')
 
+    status: int = 0
+    if os.path.isfile(ref_status):
+        with open(ref_status, mode='r', encoding='utf-8') as status_file:
+            status = int(status_file.read())
+
     if not execute(f"python3 $PCOMP_DEVROOT/tools/asm.py -o {out_hex} {in_asm}"):
         print_red('failed')
         return
-    if not execute(f"source env.sh && python3 $PCOMP_DEVROOT/tools/vm.py -e {exec_type} {out_hex} > {out_stdout}"):
+    if not execute(f"source env.sh && python3 $PCOMP_DEVROOT/tools/vm.py -e {exec_type}{vm_opts} {out_hex} > {out_stdout}; [ $? -eq {status} ]"):
         print_red('failed')
         return
     if not execute(f"diff {ref_stdout} {out_stdout}"):
@@ -37,6 +55,14 @@ def execute_tests():
     args: argparse.Namespace = parse_args()
 
     exec_type: str                          = args.exec_type
+    vm_opts: str                            = ' -l' if args.lazy else ''
+    cache_dir: str                          = create_tmpdir('jitcache-') if args.jit_cache else ''
+    if args.jit_threads:
+        vm_opts += f" -j {args.jit_threads}"
+    if args.jit_cache:
+        vm_opts += f" -c {cache_dir}"
+    if args.fuel:
+        vm_opts += f" -f {args.fuel}"
 
     in_dir: str                             = f"{args.root_dir}/in"
     ref_dir: str                            = f"{args.root_dir}/ref"
@@ -45,17 +71,22 @@ def execute_tests():
     names: List[str]                        = [f"{file.rpartition('.')[0]}" for file in list_files(in_dir, '.asm')]
     in_asm_files: List[str]                 = [f"{in_dir}/{name}.asm" for name in names]
     ref_stdout_files: List[str]             = [f"{ref_dir}/{name}.stdout" for name in names]
+    ref_status_files: List[str]             = [f"{ref_dir}/{name}.status" for name in names]
     out_hex_files: List[str]                = [f"{out_dir}/{name}.hex" for name in names]
     out_stdout_files: List[str]             = [f"{out_dir}/{name}.stdout" for name in names]
 
-    tests: zip[tuple[str, str, str, str, str]] \
-        = zip(names, in_asm_files, ref_stdout_files, out_hex_files, out_stdout_files)
+    tests: zip[tuple[str, str, str, str, str, str]] \
+        = zip(names, in_asm_files, ref_stdout_files, ref_status_files, out_hex_files, out_stdout_files)
 
-    print_green(f"*.asm -> *.stdout ({exec_type.lower()})")
-    for name, in_asm, ref_stdout, out_hex, out_stdout in tests:
-        execute_test(name, exec_type, in_asm, ref_stdout, out_hex, out_stdout)
+    print_green(f"*.asm -> *.stdout ({exec_type.lower()}{', lazy' if args.lazy else ''}{', cached' if args.jit_cache else ''}{f', {args.jit_threads} threads' if args.jit_threads else ''}{f', {args.fuel} fuel slices' if args.fuel else ''})")
+    for name, in_asm, ref_stdout, ref_status, out_hex, out_stdout in tests:
+        execute_test(name, exec_type, vm_opts, in_asm, ref_stdout, ref_status, out_hex, out_stdout)
+        if args.jit_cache:
+            execute_test(f"{name} (cached)", exec_type, vm_opts, in_asm, ref_stdout, ref_status, out_hex, out_stdout)
     
     remove_dir(out_dir)
+    if args.jit_cache:
+        remove_dir(cache_dir)
 
 
 execute_tests()
@@ -0,0 +1,9 @@
+;
+; Return into the middle of an instruction; the interpreter must
+; report a clean VM fault at the return instead of aborting.
+;
+
+main:
+    mov r0, 3               ; inside the jmp at $sys_enter
+    push r0
+    ret                     ; 0x15
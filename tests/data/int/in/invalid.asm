@@ -0,0 +1,12 @@
+;
+; Overwrite the next instruction with an invalid opcode; the
+; interpreter must report it instead of aborting.
+;
+
+main:
+    mov r1, 0
+    store [r2 + 0x17], r1
+
+    mov r0, 0               ; 0x17
+    push r0
+    call $sys_enter
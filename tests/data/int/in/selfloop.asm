@@ -0,0 +1,31 @@
+;
+; Patch the immediates of instructions in the running loop,
+; a fused cmp+jmplt included, on every one of its iterations.
+;
+
+main:
+    mov r3, 0
+    mov r4, 0
+
+.loop:
+    store [r2 + 0x23], r3   ; the immediate of the add below
+    add r4, 0               ; 0x21
+    add r3, 1
+    mov r1, 10000
+    store [r2 + 0x45], r1   ; the immediate of the cmp below
+    cmp r3, 1               ; 0x43
+    jmplt .loop
+
+    push r4
+    mov r0, 1
+    push r0
+    call $sys_enter
+
+    push r3
+    mov r0, 1
+    push r0
+    call $sys_enter
+
+    mov r0, 0
+    push r0
+    call $sys_enter
@@ -0,0 +1,25 @@
+;
+; Patch the immediate of an already executed instruction
+; and run it again.
+;
+
+main:
+    mov r3, 0
+
+.loop:
+    mov r0, 1               ; 0x13, immediate at 0x15
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+
+    mov r1, 42
+    store [r2 + 0x15], r1
+
+    add r3, 1
+    cmp r3, 2
+    jmplt .loop
+
+    mov r0, 0
+    push r0
+    call $sys_enter
@@ -0,0 +1,14 @@
+;
+; Rejected up front by the verifier; nothing is executed.
+;
+
+    mov r0, 1
+    push r0
+    push r0
+    call $sys_enter
+
+    mov r1, flags           ; 0x20, flags is not an operand
+    jmp 0x2e                ; 0x22, lands inside the next instruction
+    mov r0, 0
+    push r0
+    call $sys_enter
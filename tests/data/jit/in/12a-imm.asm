@@ -0,0 +1,149 @@
+;
+; Operands round-trip through the stack so the JIT cannot
+; fold the arithmetic into constants.
+;
+
+    mov r8, 10
+    push r8
+    pop r8
+    add r8, 1
+    sub r8, 1
+    add r8, -1
+    sub r8, -1
+    push r8
+    call print
+
+    mov r1, 0
+    push r1
+    pop r1
+    add r1, 127
+    add r1, 128
+    add r1, -128
+    add r1, -129
+    push r1
+    call print
+
+    mov r2, 0
+    push r2
+    pop r2
+    add r2, 2147483647
+    add r2, 2147483648
+    sub r2, -2147483648
+    push r2
+    call print
+
+    mov r3, -1
+    push r3
+    pop r3
+    and r3, 2147483647
+    push r3
+    call print
+
+    mov r4, -1
+    push r4
+    pop r4
+    and r4, 18446744073709551360
+    push r4
+    call print
+
+    mov r5, -1
+    push r5
+    pop r5
+    and r5, 4294967295
+    push r5
+    call print
+
+    mov r6, 0
+    push r6
+    pop r6
+    or r6, 18446744071562067968
+    push r6
+    call print
+
+    mov r12, 5
+    push r12
+    pop r12
+    xor r12, 127
+    push r12
+    call print
+
+.l1:
+    mov r0, -5
+    cmp r0, 0
+    jmplt .ok1
+    jmp .l2
+.ok1:
+    push r0
+    call print
+
+.l2:
+    mov r9, 0
+    cmp r9, 0
+    jmpeq .ok2
+    jmp .l3
+.ok2:
+    push r9
+    call print
+
+.l3:
+    mov r9, 5
+    cmp r9, 0
+    jmpgt .ok3
+    jmp .l4
+.ok3:
+    push r9
+    call print
+
+.l4:
+    mov r10, 2147483648
+    cmp r10, 2147483647
+    jmpgt .ok4
+    jmp .l5
+.ok4:
+    push r10
+    call print
+
+.l5:
+    mov r11, -2147483649
+    cmp r11, -2147483648
+    jmplt .ok5
+    jmp .l6
+.ok5:
+    push r11
+    call print
+
+.l6:
+    mov r7, 128
+    cmp r7, 127
+    jmpgt .ok6
+    jmp .l7
+.ok6:
+    push r7
+    call print
+
+.l7:
+    mov r7, -129
+    cmp r7, -128
+    jmple .ok7
+    jmp .l8
+.ok7:
+    push r7
+    call print
+
+.l8:
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
+
+print:
+    load r0, [sp + 8]
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
@@ -0,0 +1,66 @@
+;
+; Constants, copies, dead moves and a compare repeated on the
+; fall-through path of a jump; the JIT folds what it can and
+; must print the same values as the interpreter.
+;
+
+    mov r1, 6
+    mov r2, r1
+    add r2, 4
+    mov r3, r2
+    xor r3, 3
+    not r3
+    push r3
+    call print
+
+    mov r4, 7
+    push r4
+    pop r4
+    mov r5, r4
+    mov r6, r5
+    mov r5, 100
+    mov r5, r6
+    add r5, r6
+    push r5
+    call print
+
+    mov r7, 3
+    push r7
+    pop r7
+    cmp r7, 5
+    jmpgt .big
+    cmp r7, 5
+    jmpeq .big
+    cmp r7, 5
+    jmplt .small
+.big:
+    push r7
+    call print
+.small:
+    mov r8, r7
+    cmp r8, 3
+    jmpne .big
+    cmp r7, 3
+    jmpeq .done
+    jmp .big
+.done:
+    add r8, r7
+    push r8
+    call print
+
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
+
+print:
+    load r0, [sp + 8]
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
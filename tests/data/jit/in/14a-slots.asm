@@ -0,0 +1,72 @@
+;
+; Stack slots written and read back within a block, through
+; push, store, pop and sp-relative loads, with stores through
+; another base register and calls in between.
+;
+
+    mov r1, 11
+    push r1
+    pop r1
+    push r1
+    load r2, [sp + 0]
+    load r3, [sp + 0]
+    add r3, r2
+    store [sp + 0], r3
+    load r4, [sp + 0]
+    store [sp + 0], r4
+    pop r5
+    push r5
+    call print
+
+    mov r6, 5
+    push r6
+    push r6
+    pop r7
+    push r7
+    mov r8, sp
+    mov r9, 99
+    store [r8 + 8], r9
+    load r10, [sp + 8]
+    push r10
+    call print
+    add sp, 16
+
+    mov r1, 7
+    push r1
+    sub sp, 8
+    mov r2, 3
+    store [sp + 0], r2
+    add sp, 8
+    load r3, [sp - 8]
+    load r4, [sp + 0]
+    add r3, r4
+    push r3
+    call print
+    pop r1
+
+    mov r1, 1
+    push r1
+    push r1
+    call print
+    load r2, [sp + 0]
+    push r2
+    call print
+    add sp, 8
+
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
+
+print:
+    load r0, [sp + 8]
+    store [sp + 8], r0
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
@@ -0,0 +1,62 @@
+;
+; A long loop two calls deep, long enough for tiered execution to
+; switch over inside it. Both calls then return to frames set up
+; before the switch, and a pointer into the stack taken before it
+; is still good after.
+;
+
+    mov r1, 42
+    push r1
+    mov r12, sp
+    mov r0, 2000000
+    push r0
+    call outer
+    push r0
+    call print
+    load r1, [r12 + 0]
+    push r1
+    call print
+    add sp, 8
+    jmp exit
+
+outer:
+    load r0, [sp + 8]
+    push r0
+    call count
+    add r0, 1
+.return:
+    add sp, 16
+    load r2, [sp - 16]
+    push r2
+    ret
+
+count:
+    load r1, [sp + 8]
+    mov r0, 0
+.loop:
+    add r0, 3
+    sub r1, 1
+    cmp r1, 0
+    jmpgt .loop
+.return:
+    add sp, 16
+    load r2, [sp - 16]
+    push r2
+    ret
+
+print:
+    load r0, [sp + 8]
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
+
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
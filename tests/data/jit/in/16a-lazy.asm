@@ -0,0 +1,55 @@
+;
+; Control flow that compiling on first entry has to get right:
+; flags still live at a branch target, a call to code not yet
+; compiled, a jump into the middle of straight-line code compiled
+; before, and a loop whose back-edge was patched.
+;
+
+    mov r0, 3
+    cmp r0, 3
+    jmpeq .flags
+    jmp exit
+.flags:
+    jmpne exit
+    jmpge .call
+    jmp exit
+
+.call:
+    mov r1, 1
+    push r1
+    call print
+
+    mov r2, 0
+.middle:
+    add r2, 1
+    mov r0, r2
+    push r0
+    call print
+    cmp r2, 2
+    jmplt .middle
+
+    mov r3, 4
+.loop:
+    sub r3, 1
+    cmp r3, 0
+    jmpgt .loop
+    push r3
+    call print
+    jmp exit
+
+print:
+    load r0, [sp + 8]
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
+
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
@@ -0,0 +1,52 @@
+;
+; Calls between functions, one of which falls through into the next.
+; JITed on several threads, functions may each end up in a region of
+; their own, to be linked up afterwards.
+;
+
+    mov r0, 10
+    call twice_plus_one
+    push r0
+    call print
+    mov r0, 10
+    call plus_one
+    push r0
+    call print
+    mov r0, 3
+    call countdown
+    jmp exit
+
+twice_plus_one:
+    add r0, r0
+plus_one:
+    add r0, 1
+    ret
+
+countdown:
+    cmp r0, 0
+    jmple .return
+    push r0
+    push r0
+    call print
+    pop r0
+    sub r0, 1
+    call countdown
+.return:
+    ret
+
+print:
+    load r0, [sp + 8]
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+.return:
+    add sp, 16
+    load r0, [sp - 16]
+    push r0
+    ret
+
+exit:
+    mov r0, 0
+    push r0
+    call $sys_enter
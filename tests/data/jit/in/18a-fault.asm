@@ -0,0 +1,13 @@
+;
+; Pop past the top of the stack; every engine must report a clean
+; VM fault instead of reading outside its memory.
+;
+
+main:
+    mov r0, 7
+    push r0
+    mov r0, 1
+    push r0
+    call $sys_enter
+
+    pop r0                  ; 0x2a, SP is already at the top
@@ -1,8 +1,11 @@
 import argparse
 import ctypes
+import sys
 
 from enum import IntEnum, unique
 
+from asmspec import Instruction
+
 
 VM_LIB = 'vm.so'
 
@@ -12,6 +15,58 @@ class ExecType(IntEnum):
     INTERPRETER = 1
     AArch64JIT  = 2
     x86_64JIT   = 3
+    TIERED      = 4
+
+
+@unique
+class Flag(IntEnum):
+    HUGE_PAGES  = 0x1
+    STATS       = 0x2
+    FUEL        = 0x4
+    LAZY_JIT    = 0x8
+    PERF_MAP    = 0x10
+    JITDUMP     = 0x20
+    PROFILE     = 0x40
+    CALL_GRAPH  = 0x80
+    TIMINGS     = 0x100
+
+
+@unique
+class Status(IntEnum):
+    OK          = 0
+    FAULT       = 1
+    INVALID     = 2
+    OUT_OF_FUEL = 3
+
+
+VM_NUM_OPCODES = 64
+
+
+class BlockStats(ctypes.Structure):
+    _fields_ = [('addr', ctypes.c_uint64),
+                ('count', ctypes.c_uint64)]
+
+
+class FusionStats(ctypes.Structure):
+    _fields_ = [('name', ctypes.c_char_p),
+                ('sites', ctypes.c_uint64),
+                ('hits', ctypes.c_uint64)]
+
+
+class Stats(ctypes.Structure):
+    _fields_ = [('instructions', ctypes.c_uint64),
+                ('opcodes', ctypes.c_uint64 * VM_NUM_OPCODES),
+                ('num_blocks', ctypes.c_size_t),
+                ('blocks', ctypes.POINTER(BlockStats)),
+                ('num_fusions', ctypes.c_size_t),
+                ('fusions', ctypes.POINTER(FusionStats))]
+
+
+class Result(ctypes.Structure):
+    _fields_ = [('status', ctypes.c_uint8),
+                ('fault_pc', ctypes.c_uint64),
+                ('fault_addr', ctypes.c_uint64),
+                ('stats', Stats)]
 
 
 def parse_args() -> argparse.Namespace:
@@ -22,9 +77,45 @@ def parse_args() -> argparse.Namespace:
                         required=False, default=4,
                         help='the size of memory to use (in MiB); defaults to 4')
     parser.add_argument('-e', '--execution-type', metavar='EXEC_TYPE', dest='exec_type',
-                        required=False, choices=['INTERPRETER', 'AArch64JIT', 'x86_64JIT'], default='INTERPRETER',
+                        required=False, choices=['INTERPRETER', 'AArch64JIT', 'x86_64JIT', 'TIERED'], default='INTERPRETER',
                         help='''the execution type; defaults to INTERPRETER;
-                                possible values: INTERPRETER, AArch64JIT, x86_64JIT''')
+                                possible values: INTERPRETER, AArch64JIT, x86_64JIT, TIERED''')
+    parser.add_argument('-H', '--huge-pages', dest='huge_pages',
+                        required=False, action='store_true',
+                        help='back VM memory with transparent huge pages, if available')
+    parser.add_argument('-l', '--lazy', dest='lazy',
+                        required=False, action='store_true',
+                        help='JIT code on first entry instead of all up front (x86_64JIT only)')
+    parser.add_argument('-c', '--jit-cache', metavar='DIR', type=str, dest='jit_cache',
+                        required=False, default=None,
+                        help='keep JIT code in DIR and reuse it on later runs (x86_64JIT and TIERED only)')
+    parser.add_argument('-j', '--jit-threads', metavar='N', type=int, dest='jit_threads',
+                        required=False, default=0,
+                        help='JIT on N threads; defaults to 0, as many as pay off (x86_64JIT and TIERED only)')
+    parser.add_argument('-p', '--perf-map', dest='perf_map',
+                        required=False, action='store_true',
+                        help='describe JIT code to perf in /tmp/perf-<pid>.map')
+    parser.add_argument('-J', '--jitdump', dest='jitdump',
+                        required=False, action='store_true',
+                        help='describe JIT code to perf in /tmp/jit-<pid>.dump, for perf inject')
+    parser.add_argument('-L', '--labels', metavar='LBL', type=str, dest='labels',
+                        required=False, default=None,
+                        help='name VM code after the labels in LBL, as written by asm.py -l')
+    parser.add_argument('-P', '--profile', metavar='PREFIX', type=str, dest='profile',
+                        required=False, default=None,
+                        help='sample the program as it runs and write PREFIX.flat and PREFIX.folded')
+    parser.add_argument('-C', '--call-graph', metavar='PREFIX', type=str, dest='call_graph',
+                        required=False, default=None,
+                        help='time every call and return and write PREFIX.calls and PREFIX.calls.folded')
+    parser.add_argument('-f', '--fuel', metavar='FUEL', type=int, dest='fuel',
+                        required=False, default=0,
+                        help='run the program in slices of FUEL units, resuming until it finishes')
+    parser.add_argument('-t', '--timings', dest='timings',
+                        required=False, action='store_true',
+                        help='print the time each phase took, and what it used, to stderr as JSON')
+    parser.add_argument('-s', '--stats', dest='stats',
+                        required=False, action='store_true',
+                        help='print execution statistics to stderr')
     parser.add_argument('-d', '--debug', dest='debug',
                         required=False, action='store_true',
                         help='emit debug info')
@@ -39,15 +130,66 @@ def run():
         program = bytes.fromhex(' '.join([line.strip() for line in hex_file]))
     mem_size_mb: int = args.memory
     exec_type: ExecType = ExecType[args.exec_type]
+    flags: int = (Flag.HUGE_PAGES if args.huge_pages else 0) | \
+                 (Flag.STATS if args.stats else 0) | \
+                 (Flag.FUEL if args.fuel else 0) | \
+                 (Flag.LAZY_JIT if args.lazy else 0) | \
+                 (Flag.PERF_MAP if args.perf_map else 0) | \
+                 (Flag.JITDUMP if args.jitdump else 0) | \
+                 (Flag.PROFILE if args.profile is not None else 0) | \
+                 (Flag.CALL_GRAPH if args.call_graph is not None else 0) | \
+                 (Flag.TIMINGS if args.timings else 0)
     debug: bool = args.debug
 
-    ctypes.cdll.LoadLibrary(VM_LIB).vm_run(
+    vm_lib = ctypes.cdll.LoadLibrary(VM_LIB)
+    vm_lib.vm_create.restype = ctypes.c_void_p
+    vm_lib.vm_set_jit_threads(ctypes.c_size_t(args.jit_threads))
+    if args.profile is not None:
+        vm_lib.vm_set_profile_output(args.profile.encode())
+    if args.call_graph is not None:
+        vm_lib.vm_set_call_graph_output(args.call_graph.encode())
+    if args.labels is not None:
+        vm_lib.vm_set_labels(args.labels.encode())
+    if args.jit_cache is not None:
+        vm_lib.vm_set_jit_cache_dir(args.jit_cache.encode())
+    vm_lib.vm_resume.restype = ctypes.c_uint8
+    vm = ctypes.c_void_p(vm_lib.vm_create(
         program,
         ctypes.c_size_t(len(program)),
         ctypes.c_size_t(mem_size_mb),
         ctypes.c_byte(exec_type),
+        ctypes.c_uint32(flags),
         debug
-    )
+    ))
+    result = Result()
+    slices: int = 0
+    while True:
+        status: int = vm_lib.vm_resume(vm, ctypes.c_uint64(args.fuel), ctypes.byref(result))
+        slices += 1
+        if status != Status.OUT_OF_FUEL:
+            break
+        vm_lib.vm_free_result(ctypes.byref(result))
+    if args.stats:
+        sys.stdout.flush()
+        print_stats(result.stats, slices)
+    vm_lib.vm_free_result(ctypes.byref(result))
+    vm_lib.vm_destroy(vm)
+    sys.exit(status)
+
+
+def print_stats(stats: Stats, slices: int):
+    print(f"slices {slices}", file=sys.stderr)
+    print(f"instructions {stats.instructions}", file=sys.stderr)
+    for instr in Instruction:
+        if stats.opcodes[instr]:
+            print(f"opcode {instr.name.lower():<6} {stats.opcodes[instr]}", file=sys.stderr)
+    for i in range(stats.num_blocks):
+        block = stats.blocks[i]
+        print(f"block {block.addr:#x} {block.count}", file=sys.stderr)
+    for i in range(stats.num_fusions):
+        fusion = stats.fusions[i]
+        if fusion.hits:
+            print(f"fusion {fusion.name.decode():<22} {fusion.hits}", file=sys.stderr)
 
 
 run()
@@ -1,24 +1,11 @@
-#include <algorithm>
 #include <map>
+#include <ucontext.h>
 
 #include "exe.h"
 #include "a64.h"
+#include "cg.h"
 
 
-#define JIT_NEXT(OFFSET) { \
-    uint64_t va = jpos.vm - (uint8_t*) prog; \
-    idd.addr = va; \
-    va2idd[va] = idd; \
-    jpos.vm += OFFSET; \
-    return; \
-}
-#define DEFER_JIT_AND_RESERVE_SLOTS(SLOTS) { \
-    { \
-        deferred_jpos.push_back(jpos); \
-        for(size_t i = 0; i < SLOTS; i++) \
-            emit_nop(); \
-    } \
-}
 
 
 const std::map<AArch64JIT::vm_reg_t, AArch64JIT::arch_reg_t> AArch64JIT::vr2ar = {
@@ -40,8 +27,8 @@ const std::map<AArch64JIT::vm_reg_t, AArch64JIT::arch_reg_t> AArch64JIT::vr2ar =
 };
 
 
-AArch64JIT::AArch64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
-: JIT(prog, prog_size, mem_size_mb, debug)
+AArch64JIT::AArch64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: JIT(prog, prog_size, mem_size_mb, vm_flags, debug)
 {
     DBG("\ttype 'AArch64 JIT'" << endl);
 }
@@ -55,6 +42,7 @@ void AArch64JIT::jit()
 
     emit_vm_sub_entry_seq_from_host();
     emit_sys_enter_stub();
+    emit_fuel_stubs();
     emit_reg_init();
 
     jit_program();
@@ -71,18 +59,25 @@ void AArch64JIT::jit_program()
 {
     DBG("JITing program..." << endl);
 
-    while (jpos.vm < ((uint8_t*) prog) + prog_size) {
+    for (const ir_instr_t& ins : ir) {
+        // The sys_enter stub stands in for the instructions it replaced.
+        if ((const uint8_t*) prog + ins.idd.addr < jpos.vm)
+            continue;
+        jpos.vm = (const uint8_t*) prog + ins.idd.addr;
         record_addr_mapping();
-        jit_vm_instruction();
+        emit_block_count(ins.idd.addr);
+        emit_fuel_check(ins.idd.addr);
+        jit_vm_instruction(ins);
     }
-    jit_deferred();
+    jpos.vm = (const uint8_t*) prog + prog_size;
+    resolve_fixups();
 }
 
 
-void AArch64JIT::jit_vm_instruction()
+void AArch64JIT::jit_vm_instruction(const ir_instr_t& ins)
 {
     static void* instr_jit_handle[] = {
-        nullptr,
+        &&_nop,
         &&_load,
         &&_store,
         &&_mov,
@@ -106,277 +101,267 @@ void AArch64JIT::jit_vm_instruction()
         &&_jmple,
     };
 
-    instr_decode_data_t idd = { 0, 0, 0, 0, 0, 0, 0 };
+    const instr_decode_data_t& idd = ins.idd;
 
-    goto *instr_jit_handle[instr(*jpos.vm)];
+    goto *instr_jit_handle[ins.op];
+
+    _nop:
+        return;
 
     _load: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
-        idd.src = reg_src(*(jpos.vm + 1));
-        idd.idx = imm16s(*(jpos.vm + 2));
         emit_mov_reg_imm(R11, idd.idx);
         emit_adds_ereg(R11, as_arch_reg(idd.src), R11);
         emit_ldr_unsigned_offset(as_arch_reg(idd.dst), R11, 0);
-        JIT_NEXT(+4);
+        return;
     }
 
     _store: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
-        idd.src = reg_src(*(jpos.vm + 1));
-        idd.idx = imm16s(*(jpos.vm + 2));
         emit_mov_reg_imm(R11, idd.idx);
         emit_adds_ereg(R11, as_arch_reg(idd.dst), R11);
         emit_str_unsigned_offset(as_arch_reg(idd.src), R11, 0);
-        JIT_NEXT(+4);
+        return;
     }
 
     _mov: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_mov_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _add: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_adds_ereg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(R11, idd.ivs);
             emit_adds_ereg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), R11);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _sub: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_subs_ereg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(R11, idd.ivs);
             emit_subs_ereg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), R11);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _and: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_and_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(R11, idd.ivs);
             emit_and_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), R11);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _or: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_orr_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(R11, idd.ivs);
             emit_orr_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), R11);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _xor: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_eor_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(R11, idd.ivs);
             emit_eor_sreg(as_arch_reg(idd.dst), as_arch_reg(idd.dst), R11);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _not: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_orn_sreg(as_arch_reg(idd.dst), ZR, as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _cmp: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_cmp_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_cmp_reg_imm(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _push: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_push_reg(as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _pop: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_pop_reg(as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _call: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
+        if ((vm_flags & VM_CALL_GRAPH) && idd.ivu != SYS_ENTER_ADDR)
+            emit_call_graph_call((const void*) call_entered, idd.ivu);
         uint64_t va = as_arch_addr(idd.ivu);
+        emit_adr(R11, +3 * 4);
+        emit_push_reg(R11);
         if (va != (uint64_t) -1) {
-            emit_adr(R11, +7 * 4);
-            emit_push_reg(R11);
-            uint8_t *target_jpos_arch = jpos.arch + 4 * 4;
-            emit_mov_reg_imm(R11, va);
-            while (jpos.arch < target_jpos_arch)
-                emit_nop();
-            emit_br(R11);
+            emit_b((uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+7);
+            emit_b(0);
+            record_fixup(FIXUP_IMM26, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _ret: {
+        if (vm_flags & VM_CALL_GRAPH)
+            emit_call_graph_call((const void*) call_left, 0);
         emit_pop_reg(LR);
         emit_ret();
-        JIT_NEXT(+1);
+        return;
     }
 
     _jmp: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
-            emit_mov_reg_imm(R11, va);
-            emit_br(R11);
+            emit_b((uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+5);
+            emit_b(0);
+            record_fixup(FIXUP_IMM26, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmpeq: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(EQ, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(EQ, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmpne: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(NE, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(NE, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmpgt: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(GT, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(GT, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmplt: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(LT, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(LT, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmpge: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(GE, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(GE, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _jmple: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_b_cond(LE, (uint32_t*) va - (uint32_t*) jpos.arch);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+1);
+            emit_b_cond(LE, 0);
+            record_fixup(FIXUP_IMM19, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 }
 
 
-void AArch64JIT::jit_deferred()
+void AArch64JIT::patch_fixup(const fixup_t& fixup, const uint8_t* target)
 {
-    jit_pos_t cur_jpos = jpos;
-    std::for_each(deferred_jpos.begin(), deferred_jpos.end(), [this](jit_pos_t& jp) {
-        jpos = jp;
-        jit_vm_instruction();
-    });
-    jpos = cur_jpos;
+    uint32_t* instr = (uint32_t*) fixup.arch - 1;
+    int64_t imm = (uint32_t*) target - instr;
+
+    switch (fixup.kind) {
+    case FIXUP_IMM26:
+        if (imm < -(1 << 25) || imm >= (1 << 25))
+            ABORT("Branch target out of range." << endl);
+        *instr |= imm & 0b00000011111111111111111111111111;
+        break;
+    case FIXUP_IMM19:
+        if (imm < -(1 << 18) || imm >= (1 << 18))
+            ABORT("Branch target out of range." << endl);
+        *instr |= (imm & 0b00000000000001111111111111111111) << 5;
+        break;
+    }
+}
+
+
+const uint64_t* AArch64JIT::sampled_vm_sp(const void* ctx, bool in_code) const
+{
+    // Host code may have X28 saved away and in use for something else.
+    if (!in_code)
+        return nullptr;
+#if defined(__linux__) && defined(__aarch64__)
+    return (const uint64_t*) ((const ucontext_t*) ctx)->uc_mcontext.regs[R28];
+#elif defined(__APPLE__) && defined(__aarch64__)
+    return (const uint64_t*) ((const ucontext_t*) ctx)->uc_mcontext->__ss.__x[R28];
+#else
+    (void) ctx;
+    return nullptr;
+#endif
 }
 
 
@@ -410,11 +395,15 @@ void AArch64JIT::emit_non_vm_sub_entry_seq_to_host()
 {
     emit_stp_pre_idx(R14, R15, SP, -16);
     emit_stp_pre_idx(R12, R13, SP, -16);
+    if (vm_flags & VM_FUEL)
+        emit_stp_pre_idx(FUEL_REG, R10, SP, -16);
 }
 
 
 void AArch64JIT::emit_non_vm_sub_exit_seq_to_host()
 {
+    if (vm_flags & VM_FUEL)
+        emit_ldp_post_idx(FUEL_REG, R10, SP, 16);
     emit_ldp_post_idx(R12, R13, SP, 16);
     emit_ldp_post_idx(R14, R15, SP, 16);
 }
@@ -429,6 +418,7 @@ void AArch64JIT::emit_sys_enter_stub()
     jpos.arch += 4;
     sys_enter_stub = jpos.arch;
     record_addr_mapping();
+    emit_block_count(SYS_ENTER_ADDR);
     emit_ldr_unsigned_offset(R27, as_arch_reg(vm_reg_t::SP), 1);
     emit_cmp_reg_imm(R27, 0);
     pj1 = jpos.arch;
@@ -454,6 +444,39 @@ void AArch64JIT::emit_sys_enter_stub()
 }
 
 
+void AArch64JIT::emit_fuel_stubs()
+{
+    if (!(vm_flags & VM_FUEL))
+        return;
+
+    uint8_t *pj0, *pn0;
+
+    pj0 = jpos.arch;
+    jpos.arch += 4;
+
+    // Entered by bl; the VM stack keeps where to resume.
+    yield_stub = jpos.arch;
+    emit_push_reg(LR);
+    emit_mov_reg_imm(R11, (uint64_t) fuel_counter);
+    emit_str_unsigned_offset(FUEL_REG, R11, 0);
+    emit_vm_reg_save_seq();
+    emit_vm_sub_exit_seq_to_host();
+
+    resume_stub = jpos.arch;
+    emit_vm_sub_entry_seq_from_host();
+    emit_vm_reg_restore_seq();
+    emit_mov_reg_imm(R11, (uint64_t) fuel_counter);
+    emit_ldr_unsigned_offset(FUEL_REG, R11, 0);
+    emit_pop_reg(LR);
+    emit_ret();
+    pn0 = jpos.arch;
+
+    jpos.arch = pj0;
+    emit_b((uint32_t*) pn0 - (uint32_t*) pj0);
+    jpos.arch = pn0;
+}
+
+
 void AArch64JIT::emit_vm_reg_save_seq()
 {
     emit_mov_reg_imm(R11, (uint64_t) reg_dump_area.get());
@@ -475,6 +498,27 @@ void AArch64JIT::emit_vm_reg_save_seq()
 }
 
 
+void AArch64JIT::emit_vm_reg_restore_seq()
+{
+    emit_mov_reg_imm(R11, (uint64_t) reg_dump_area.get());
+
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R0),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R1),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R2),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R3),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R4),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R5),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R6),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R7),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R8),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R9),  R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R10), R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R11), R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::R12), R11, 8);
+    emit_ldr_post_idx(as_arch_reg(vm_reg_t::SP),  R11, 8);
+}
+
+
 void AArch64JIT::emit_reg_init()
 {
     emit_mov_reg_imm(as_arch_reg(vm_reg_t::R0),  0);
@@ -492,6 +536,11 @@ void AArch64JIT::emit_reg_init()
     emit_mov_reg_imm(as_arch_reg(vm_reg_t::R12), 0);
 
     emit_mov_reg_imm(as_arch_reg(vm_reg_t::SP),  (uint64_t) stack);
+
+    if (vm_flags & VM_FUEL) {
+        emit_mov_reg_imm(R11, (uint64_t) fuel_counter);
+        emit_ldr_unsigned_offset(FUEL_REG, R11, 0);
+    }
 }
 
 
@@ -600,6 +649,16 @@ void AArch64JIT::emit_orr_sreg(arch_reg_t rd, arch_reg_t rs1, arch_reg_t rs2)
 }
 
 
+void AArch64JIT::emit_subs(arch_reg_t rd, arch_reg_t rs, uint16_t imm)
+{
+    *((uint32_t*) jpos.arch)    = SUBS_IMM
+                                | ((imm & 0b0000111111111111) << 10)
+                                | (rs << 5)
+                                | rd;
+    jpos.arch += 4;
+}
+
+
 void AArch64JIT::emit_subs_ereg(arch_reg_t rd, arch_reg_t rs1, arch_reg_t rs2)
 {
     *((uint32_t*) jpos.arch)    = SUBS_EREG
@@ -791,6 +850,22 @@ void AArch64JIT::emit_mov_reg_sp(arch_reg_t rd, arch_reg_t rs)
 }
 
 
+void AArch64JIT::emit_mrs_nzcv(arch_reg_t rd)
+{
+    *((uint32_t*) jpos.arch)    = MRS_NZCV
+                                | rd;
+    jpos.arch += 4;
+}
+
+
+void AArch64JIT::emit_msr_nzcv(arch_reg_t rs)
+{
+    *((uint32_t*) jpos.arch)    = MSR_NZCV
+                                | rs;
+    jpos.arch += 4;
+}
+
+
 void AArch64JIT::emit_pop_reg(arch_reg_t rd)
 {
     emit_ldr_post_idx(rd, as_arch_reg(vm_reg_t::SP), 8);
@@ -816,3 +891,68 @@ void AArch64JIT::emit_sys_enter_call()
     emit_blr(R11);
     emit_mov_reg_reg(as_arch_reg(vm_reg_t::SP), R0);
 }
+
+
+void AArch64JIT::emit_block_count(uint64_t vm_addr)
+{
+    uint64_t* counter = block_counter(vm_addr);
+    if (counter == nullptr)
+        return;
+
+    // Block entries may sit between a cmp and its branch; none of these set NZCV.
+    emit_mov_reg_imm(R11, (uint64_t) counter);
+    emit_ldr_unsigned_offset(R10, R11, 0);
+    emit_add(R10, R10, 1);
+    emit_str_unsigned_offset(R10, R11, 0);
+}
+
+
+void AArch64JIT::emit_fuel_check(uint64_t vm_addr)
+{
+    if (!needs_fuel_check(vm_addr))
+        return;
+
+    // Running dry yields with the flags still on the VM stack.
+    bool save_flags = flags_live_at(vm_addr);
+    if (save_flags) {
+        emit_mrs_nzcv(R10);
+        emit_push_reg(R10);
+    }
+    emit_subs(FUEL_REG, FUEL_REG, 1);
+    emit_b_cond(PL, 2);
+    emit_bl((uint32_t*) yield_stub - (uint32_t*) jpos.arch);
+    if (save_flags) {
+        emit_pop_reg(R10);
+        emit_msr_nzcv(R10);
+    }
+}
+
+
+void AArch64JIT::emit_call_graph_call(const void* fn, uint64_t vm_target)
+{
+    // The flags may still be live; LR is only loaded by ret, after this.
+    emit_mrs_nzcv(R10);
+    emit_push_reg(R10);
+    emit_non_vm_sub_entry_seq_to_host();
+    emit_mov_reg_reg(R0, as_arch_reg(vm_reg_t::SP));
+    emit_mov_reg_imm(R1, (uint64_t) this);
+    emit_mov_reg_imm(R2, vm_target);
+    emit_mov_reg_imm(R11, (uint64_t) fn);
+    emit_blr(R11);
+    emit_non_vm_sub_exit_seq_to_host();
+    emit_pop_reg(R10);
+    emit_msr_nzcv(R10);
+}
+
+
+void AArch64JIT::call_entered(const uint64_t* sp, AArch64JIT* jit, uint64_t vm_target)
+{
+    // The call pushes its return address where the flags are now.
+    jit->call_graph->enter(vm_target, sp);
+}
+
+
+void AArch64JIT::call_left(const uint64_t* sp, AArch64JIT* jit, uint64_t)
+{
+    jit->call_graph->leave(sp + 1);
+}
@@ -8,7 +8,7 @@
 
 class AArch64JIT final : public JIT {
 public:
-    AArch64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug);
+    AArch64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
 
 private:
     static constexpr const char* OBJDUMP_FMT        = "objdump -b binary -m aarch64 --adjust-vma 0x%llx -D %s > %s";
@@ -60,6 +60,14 @@ private:
 
     static const std::map<vm_reg_t, arch_reg_t> vr2ar;
 
+    // Not a VM register; holds the fuel left with VM_FUEL.
+    static constexpr arch_reg_t FUEL_REG            = R9;
+
+    typedef enum : uint8_t {
+        FIXUP_IMM26                                 = 0,    // B/BL
+        FIXUP_IMM19                                 = 1,    // B.cond
+    } fixup_kind_t;
+
     typedef enum : uint32_t {
         // Data Processing -- Immediate
         DG0_DP_IMM                                  = 0b00010000000000000000000000000000,
@@ -83,6 +91,8 @@ private:
             DG0_BR_EG_SYS_DG1_CBR_IMM               = 0b01000000000000000000000000000000,
             // Hints
             DG0_BR_EG_SYS_DG1_HINT                  = 0b11000001000000110010000000011111,
+            // System register move
+            DG0_BR_EG_SYS_DG1_SYS_REG_MOVE          = 0b11000001000100000000000000000000,
             // Unconditional branch (register)
             DG0_BR_EG_SYS_DG1_UBR_R                 = 0b11000010000000000000000000000000,
             // Unconditional branch (immediate)
@@ -142,6 +152,12 @@ private:
         LDR_UNSIGNED_OFFSET                         = DG0_LS
                                                     | DG0_LS_DG1_LSR_UNSIGNED_IMM
                                                     | 0b11000000010000000000000000000000,
+        MRS_NZCV                                    = DG0_BR_EG_SYS
+                                                    | DG0_BR_EG_SYS_DG1_SYS_REG_MOVE
+                                                    | 0b00000000001010110100001000000000,
+        MSR_NZCV                                    = DG0_BR_EG_SYS
+                                                    | DG0_BR_EG_SYS_DG1_SYS_REG_MOVE
+                                                    | 0b00000000000010110100001000000000,
         MOVK                                        = DG0_DP_IMM
                                                     | DG0_DP_IMM_DG1_MOV_WIDE_IMM
                                                     | 0b11100000000000000000000000000000,
@@ -172,6 +188,9 @@ private:
         STR_UNSIGNED_OFFSET                         = DG0_LS
                                                     | DG0_LS_DG1_LSR_UNSIGNED_IMM
                                                     | 0b11000000000000000000000000000000,
+        SUBS_IMM                                    = DG0_DP_IMM
+                                                    | DG0_DP_IMM_DG1_ADD_SUB_IMM
+                                                    | 0b11100000000000000000000000000000,
         SUBS_EREG                                   = DG0_DP_REG
                                                     | DG0_DP_REG_DG1_ADD_SUB_EREG
                                                     | 0b11100000000000000000000000000000,
@@ -189,6 +208,7 @@ private:
     typedef enum : uint8_t {
         EQ                                          = 0b00000000,
         NE                                          = 0b00000001,
+        PL                                          = 0b00000101,
         GE                                          = 0b00001010,
         LT                                          = 0b00001011,
         GT                                          = 0b00001100,
@@ -196,8 +216,13 @@ private:
     } arch_cond_t;
 
     void jit_program();
-    void jit_vm_instruction();
-    void jit_deferred();
+    void jit_vm_instruction(const ir_instr_t& ins);
+    void patch_fixup(const fixup_t& fixup, const uint8_t* target) override;
+    bool fits_short_branch(int64_t) const override  { return false; }
+    const uint64_t* sampled_vm_sp(const void* ctx, bool in_code) const override;
+
+    bool clobbers_flags(const ir_instr_t& ins) const override
+                                                    { return ins.op == LOAD || ins.op == STORE || ins.op == ADD || ins.op == SUB; }
 
     void emit_vm_sub_entry_seq_from_host();
     void emit_vm_sub_exit_seq_to_host();
@@ -205,7 +230,9 @@ private:
     void emit_non_vm_sub_exit_seq_to_host();
 
     void emit_sys_enter_stub();
+    void emit_fuel_stubs();
     void emit_vm_reg_save_seq();
+    void emit_vm_reg_restore_seq();
     void emit_reg_init();
     void emit_vm_exit_syscall_guard();
 
@@ -222,6 +249,7 @@ private:
     void emit_movz(arch_reg_t rd, uint8_t shift, int16_t imm);
     void emit_orn_sreg(arch_reg_t rd, arch_reg_t rs1, arch_reg_t rs2);
     void emit_orr_sreg(arch_reg_t rd, arch_reg_t rs1, arch_reg_t rs2);
+    void emit_subs(arch_reg_t rd, arch_reg_t rs, uint16_t imm);
     void emit_subs_ereg(arch_reg_t rd, arch_reg_t rs1, arch_reg_t rs2);
                                             
     // Load/Store
@@ -248,9 +276,19 @@ private:
     void emit_mov_reg_imm(arch_reg_t rd, int64_t imm);
     void emit_mov_reg_reg(arch_reg_t rd, arch_reg_t rs);
     void emit_mov_reg_sp(arch_reg_t rd, arch_reg_t rs);
+    void emit_mrs_nzcv(arch_reg_t rd);
+    void emit_msr_nzcv(arch_reg_t rs);
     void emit_pop_reg(arch_reg_t rd);
     void emit_push_reg(arch_reg_t rs);
     void emit_ret();
 
     void emit_sys_enter_call();
+    void emit_block_count(uint64_t vm_addr);
+    void emit_fuel_check(uint64_t vm_addr);
+
+    // With VM_CALL_GRAPH, code reports calls and returns through these, with
+    // the VM stack pointer once the flags are pushed.
+    void emit_call_graph_call(const void* fn, uint64_t vm_target);
+    static void call_entered(const uint64_t* sp, AArch64JIT* jit, uint64_t vm_target);
+    static void call_left(const uint64_t* sp, AArch64JIT* jit, uint64_t);
 };
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <unistd.h>
+
+#include "vm.h"
+#include "cg.h"
+
+
+std::string CallGraph::output;
+
+
+CallGraph::CallGraph(ExecutionEngine* engine)
+: engine(engine)
+, frames(new frame_t[MAX_DEPTH]), depth(0), untimed(0)
+, started(false), stopped_at(0), paused(0)
+{
+    // The entry point is a function of its own, unless it is called too.
+    funcs_at.assign(std::max<size_t>(engine->prog_size, ENTRY_ADDR + 1), 0);
+    funcs.push_back({ ENTRY_ADDR, 0, 0, 0, 0 });
+    for (uint64_t addr : engine->call_targets) {
+        if (addr == ENTRY_ADDR || addr >= funcs_at.size())
+            continue;
+        funcs_at[addr] = funcs.size();
+        funcs.push_back({ addr, 0, 0, 0, 0 });
+    }
+    nodes.push_back({ 0, NO_NODE, NO_NODE, NO_NODE, 0, 0 });
+}
+
+
+void CallGraph::start()
+{
+    uint64_t t = read_cycles();
+    if (started) {
+        paused += t - stopped_at;
+        return;
+    }
+
+    started = true;
+    frames[0] = { NO_NODE, UINTPTR_MAX, t, 0 };
+    frames[1] = { 0, UINTPTR_MAX, t, 0 };
+    depth = 2;
+    nodes[0].calls = 1;
+    funcs[0].calls = 1;
+    funcs[0].active = 1;
+}
+
+
+void CallGraph::stop()
+{
+    stopped_at = read_cycles();
+}
+
+
+void CallGraph::report()
+{
+    if (!started)
+        return;
+
+    const bool debug = engine->debug;
+    engine->load_labels();
+
+    // Whatever is still open ran up to the end of the program.
+    uint64_t t = stopped_at - paused;
+    while (depth > 1)
+        close(t);
+
+    std::string prefix = !output.empty() ? output : "/tmp/vm-" + std::to_string(getpid());
+
+    std::vector<const func_t*> by_cycles;
+    uint64_t calls = 0;
+    for (const func_t& func : funcs) {
+        if (func.calls == 0)
+            continue;
+        by_cycles.push_back(&func);
+        calls += func.calls;
+    }
+    std::stable_sort(by_cycles.begin(), by_cycles.end(),
+        [](const func_t* a, const func_t* b) { return a->exclusive > b->exclusive; });
+    std::ofstream cf(prefix + ".calls", std::ios::trunc);
+    cf << "# " << calls << " calls, timed in cycles; " << untimed << " more past " << MAX_DEPTH
+       << " frames or " << MAX_NODES << " paths, not timed" << endl;
+    cf << "#     calls        inclusive        exclusive  function" << endl;
+    for (const func_t* func : by_cycles)
+        cf << std::setw(11) << std::setfill(' ') << func->calls << " "
+           << std::setw(16) << func->inclusive << " "
+           << std::setw(16) << func->exclusive << "  "
+           << engine->label_of(func->addr) << endl;
+    if (!cf)
+        ERR("Failed to write call graph '" << prefix << ".calls'." << endl);
+
+    std::map<std::string, uint64_t> folded;
+    for (uint32_t n = 0; n < nodes.size(); n++)
+        if (nodes[n].cycles != 0)
+            folded[path_of(n)] += nodes[n].cycles;
+    std::ofstream sf(prefix + ".calls.folded", std::ios::trunc);
+    for (const auto& [path, cycles] : folded)
+        sf << path << " " << cycles << endl;
+    if (!sf)
+        ERR("Failed to write call graph '" << prefix << ".calls.folded'." << endl);
+
+    DBG("Call graph of " << calls << " calls in " << prefix << ".calls{,.folded}" << endl);
+}
+
+
+uint32_t CallGraph::add_node(uint32_t parent, uint32_t func)
+{
+    if (nodes.size() == MAX_NODES)
+        return NO_NODE;
+    nodes.push_back({ func, parent, NO_NODE, nodes[parent].child, 0, 0 });
+    return nodes[parent].child = nodes.size() - 1;
+}
+
+
+std::string CallGraph::path_of(uint32_t node) const
+{
+    std::vector<uint32_t> path;
+    for (uint32_t n = node; n != NO_NODE; n = nodes[n].parent)
+        path.push_back(n);
+
+    std::string folded;
+    for (auto n = path.rbegin(); n != path.rend(); n++)
+        folded += (folded.empty() ? "" : ";") + engine->label_of(funcs[nodes[*n].func].addr);
+    return folded;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "exe.h"
+
+
+/* Call-graph profiling, with VM_CALL_GRAPH.
+ *
+ * Engines report every VM call and return as the program runs: enter() with
+ * the VM address called, leave() at the return, both with where on the VM
+ * stack the return address is, which is what ties a return to its call.
+ * Open calls are kept on a shadow stack of at most MAX_DEPTH frames, each a
+ * node of the calling context tree: a function, reached by a given path of
+ * calls from the entry point. A node counts its calls and the cycles spent
+ * in it but not in its callees; a function, its calls and the cycles spent
+ * in it with and without its callees, a recursive call only counted once in
+ * the former.
+ *
+ * A return closes the frame it takes the return address of, and any frame
+ * deeper on the VM stack, left behind by code that unwound it without
+ * returning. A return without a frame, as from a syscall, closes none. Calls
+ * past MAX_DEPTH, or that would make more than MAX_NODES nodes, are not
+ * timed: their cycles go to their caller. This keeps deep recursion cheap,
+ * and the folded stacks, a line per node, of a size flame graph tools take.
+ *
+ * Cycles are read from the TSC on x86_64 and from the virtual counter on
+ * AArch64; time between runs of a program that ran out of fuel is left out.
+ */
+class CallGraph final {
+public:
+    explicit CallGraph(ExecutionEngine* engine);
+
+    static void set_output(const char* prefix)      { output = prefix != nullptr ? prefix : ""; }
+
+    void start();
+    void stop();
+    void report();
+
+    // ret_slot is where the return address of the call is, or is about to be.
+    void enter(uint64_t vm_addr, const void* ret_slot);
+    void leave(const void* ret_slot);
+
+private:
+    static constexpr size_t MAX_DEPTH               = 1 << 10;
+    static constexpr size_t MAX_NODES               = 1 << 20;
+    static constexpr uint32_t NO_NODE               = (uint32_t) -1;
+    // Where the program starts, after the jump at SYS_ENTER_ADDR.
+    static constexpr uint64_t ENTRY_ADDR            = 9;
+
+    static std::string                              output;
+
+    ExecutionEngine                                 *engine;
+
+    typedef struct {
+        uint64_t                                    addr;
+        uint64_t                                    calls;
+        uint64_t                                    inclusive;
+        uint64_t                                    exclusive;
+        uint64_t                                    active;     // frames open on the shadow stack
+    } func_t;
+
+    typedef struct {
+        uint32_t                                    func;
+        uint32_t                                    parent;
+        uint32_t                                    child;      // the latest callee, NO_NODE for none
+        uint32_t                                    sibling;    // the callee of the parent before this one
+        uint64_t                                    calls;
+        uint64_t                                    cycles;     // without callees
+    } node_t;
+
+    typedef struct {
+        uint32_t                                    node;
+        uintptr_t                                   ret_slot;
+        uint64_t                                    entered;
+        uint64_t                                    callees;    // cycles spent in callees so far
+    } frame_t;
+
+    // Indexed by VM address, for call targets and the entry point.
+    std::vector<uint32_t>                           funcs_at;
+    std::vector<func_t>                             funcs;
+    std::vector<node_t>                             nodes;
+
+    // frames[0] stands in for the caller of the entry point, so that every
+    // frame has a parent and the entry point is never closed by a return.
+    std::unique_ptr<frame_t[]>                      frames;
+    size_t                                          depth;
+    uint64_t                                        untimed;
+
+    bool                                            started;
+    uint64_t                                        stopped_at;
+    uint64_t                                        paused;
+
+    static uint64_t read_cycles();
+    uint64_t now() const                            { return read_cycles() - paused; }
+
+    uint32_t callee(uint32_t parent, uint32_t func);
+    void close(uint64_t t);
+    uint32_t add_node(uint32_t parent, uint32_t func);
+    std::string path_of(uint32_t node) const;
+};
+
+
+inline uint64_t CallGraph::read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    asm volatile("mrs %0, cntvct_el0" : "=r" (t));
+    return t;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+
+inline void CallGraph::enter(uint64_t vm_addr, const void* ret_slot)
+{
+    uint32_t node = depth < MAX_DEPTH ? callee(frames[depth - 1].node, funcs_at[vm_addr]) : NO_NODE;
+    if (node == NO_NODE) {
+        untimed++;
+        return;
+    }
+    nodes[node].calls++;
+    funcs[nodes[node].func].calls++;
+    funcs[nodes[node].func].active++;
+    frames[depth++] = { node, (uintptr_t) ret_slot, now(), 0 };
+}
+
+
+inline void CallGraph::leave(const void* ret_slot)
+{
+    if (frames[depth - 1].ret_slot > (uintptr_t) ret_slot)
+        return;
+    uint64_t t = now();
+    do
+        close(t);
+    while (frames[depth - 1].ret_slot <= (uintptr_t) ret_slot);
+}
+
+
+inline uint32_t CallGraph::callee(uint32_t parent, uint32_t func)
+{
+    for (uint32_t c = nodes[parent].child; c != NO_NODE; c = nodes[c].sibling)
+        if (nodes[c].func == func)
+            return c;
+    return add_node(parent, func);
+}
+
+
+inline void CallGraph::close(uint64_t t)
+{
+    const frame_t& f = frames[--depth];
+    uint64_t elapsed = t - f.entered;
+    node_t& node = nodes[f.node];
+    func_t& func = funcs[node.func];
+    node.cycles += elapsed - f.callees;
+    func.exclusive += elapsed - f.callees;
+    if (--func.active == 0)
+        func.inclusive += elapsed;
+    frames[depth - 1].callees += elapsed;
+}
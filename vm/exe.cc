@@ -1,8 +1,44 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/mman.h>
+#include <ucontext.h>
+
 #include "exe.h"
+#include "prof.h"
+#include "cg.h"
+
+
+#define VERIFY_ERR(ADDR, DATA) { \
+    errors++; \
+    ERR("Invalid program at " << HEX_0(ADDR) << ": " << DATA); \
+}
+
+
+std::string ExecutionEngine::labels_file;
+
+
+static thread_local ExecutionEngine* trapping_engine = nullptr;
+static struct sigaction prev_sigsegv_action, prev_sigbus_action;
 
 
-ExecutionEngine::ExecutionEngine(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
-: prog(prog), prog_size(prog_size), mem_size(mem_size_mb << 20), debug(debug)
+static uint64_t ns_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+ExecutionEngine::ExecutionEngine(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: prog(prog), prog_size(prog_size), mem_size(mem_size_mb << 20), vm_flags(vm_flags), debug(debug)
+, call_graph(nullptr)
+, fuel(0)
+, mapped(0), peak_mapped(0)
+, run_state(NOT_STARTED), final_status(VM_OK), phase_stats()
+, fault_pc(UNKNOWN_ADDR), fault_addr(UNKNOWN_ADDR), raised_status(VM_OK)
 {
     DBG("Initializing VM with:" << endl);
     DBG("\tprogram at " << prog << ", size " << prog_size << endl);
@@ -15,6 +51,102 @@ ExecutionEngine::~ExecutionEngine()
 }
 
 
+vm_status_t ExecutionEngine::run(uint64_t fuel, vm_result_t* result)
+{
+    if (run_state == NOT_STARTED) {
+        auto start = std::chrono::steady_clock::now();
+        bool valid = verify_program();
+        phase_stats.verify_ns = ns_since(start);
+        if (!valid) {
+            run_state = FINISHED;
+            final_status = VM_INVALID;
+            if (vm_flags & VM_TIMINGS)
+                print_phase_stats(VM_INVALID);
+        } else {
+            if (vm_flags & VM_CALL_GRAPH) {
+                own_call_graph.reset(new CallGraph(this));
+                call_graph = own_call_graph.get();
+            }
+            start = std::chrono::steady_clock::now();
+            init_execution();
+            phase_stats.init_ns = ns_since(start);
+            start = std::chrono::steady_clock::now();
+            load_program();
+            phase_stats.load_ns = ns_since(start);
+            if (vm_flags & VM_PROFILE)
+                profiler.reset(new Profiler(this));
+            run_state = SUSPENDED;
+        }
+    }
+
+    vm_status_t status = final_status;
+    if (run_state == SUSPENDED) {
+        this->fuel = fuel;
+        if (profiler)
+            profiler->start();
+        if (call_graph)
+            call_graph->start();
+        auto start = std::chrono::steady_clock::now();
+        status = exec_trapping_faults();
+        phase_stats.exec_ns += ns_since(start);
+        if (call_graph)
+            call_graph->stop();
+        if (profiler)
+            profiler->stop();
+        if (vm_flags & VM_STATS)
+            collect_stats();
+        if (status != VM_OUT_OF_FUEL) {
+            final_status = status;
+            finish(status);
+        }
+    }
+
+    if (result != nullptr)
+        fill_result(status, *result);
+    return status;
+}
+
+
+void ExecutionEngine::stop()
+{
+    if (run_state == SUSPENDED)
+        finish(VM_OUT_OF_FUEL);
+    run_state = FINISHED;
+}
+
+
+void ExecutionEngine::finish(vm_status_t status)
+{
+    if (profiler)
+        profiler->report();
+    if (call_graph)
+        call_graph->report();
+    phase_stats.code_bytes = code_size();
+    auto start = std::chrono::steady_clock::now();
+    fini_execution();
+    phase_stats.fini_ns = ns_since(start);
+    phase_stats.peak_mapped_bytes = peak_mapped_size();
+    run_state = FINISHED;
+    if (vm_flags & VM_TIMINGS)
+        print_phase_stats(status);
+}
+
+
+void ExecutionEngine::print_phase_stats(vm_status_t status) const
+{
+    const vm_phase_stats_t& ps = phase_stats;
+    std::cerr << "{\"status\": " << (int) status
+              << ", \"verify_ns\": " << ps.verify_ns
+              << ", \"init_ns\": " << ps.init_ns
+              << ", \"load_ns\": " << ps.load_ns
+              << ", \"exec_ns\": " << ps.exec_ns
+              << ", \"fini_ns\": " << ps.fini_ns
+              << ", \"code_bytes\": " << ps.code_bytes
+              << ", \"peak_mapped_bytes\": " << ps.peak_mapped_bytes
+              << "}" << endl;
+}
+
+
 void ExecutionEngine::trace_instr_decode(const void* mem, const instr_decode_data_t& idd) const
 {
     if (!debug)
@@ -90,3 +222,382 @@ void ExecutionEngine::trace_instr_decode(const void* mem, const instr_decode_dat
     }
     DBG_(endl);
 }
+
+
+bool ExecutionEngine::verify_program()
+{
+    DBG("Verifying program ..." << endl);
+
+    static const uint8_t AM_REG_IDX = 2;
+    static const uint8_t AM_FULL_MASK = 0x03;
+
+    const uint8_t* code = (const uint8_t*) prog;
+    std::vector<bool> boundary(prog_size + 1, false);
+    std::vector<bool> leader(prog_size + 1, false);
+    std::vector<std::pair<uint64_t, uint64_t>> targets;
+    size_t errors = 0;
+
+    auto check_reg = [&errors](uint64_t addr, uint8_t reg) {
+        if (reg == FLAGS || reg == PC)
+            VERIFY_ERR(addr, "register '" << (reg == FLAGS ? "flags" : "pc") << "' is not a valid operand." << endl);
+    };
+
+    uint64_t addr = 0;
+    while (addr < prog_size) {
+        boundary[addr] = true;
+
+        uint8_t op = code[addr];
+        uint8_t am = op & AM_FULL_MASK;
+        uint8_t expected_am;
+        uint8_t len;
+        switch (instr(op)) {
+        case LOAD:
+        case STORE:
+            expected_am = AM_REG_IDX;
+            len = 4;
+            break;
+        case MOV:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+        case CMP:
+            expected_am = am == IMM ? IMM : REG;
+            len = am == IMM ? 10 : 2;
+            break;
+        case NOT:
+        case PUSH:
+        case POP:
+            expected_am = REG;
+            len = 2;
+            break;
+        case RET:
+            expected_am = REG;
+            len = 1;
+            break;
+        case CALL:
+        case JMP:
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+        case JMPGE:
+        case JMPLE:
+            expected_am = IMM;
+            len = 9;
+            break;
+        default:
+            VERIFY_ERR(addr, "unsupported instruction '" << HEX(2, (int) op) << "'." << endl);
+            return false;
+        }
+
+        if (am != expected_am)
+            VERIFY_ERR(addr, "unsupported access mode " << (int) am << " for instruction '" << HEX(2, (int) op) << "'." << endl);
+        if (addr + len > prog_size) {
+            VERIFY_ERR(addr, "truncated instruction." << endl);
+            return false;
+        }
+
+        switch (instr(op)) {
+        case LOAD:
+        case STORE:
+            check_reg(addr, reg_dst(code[addr + 1]));
+            check_reg(addr, reg_src(code[addr + 1]));
+            break;
+        case MOV:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+        case CMP:
+            check_reg(addr, reg_dst(code[addr + 1]));
+            if (am == REG)
+                check_reg(addr, reg_src(code[addr + 1]));
+            break;
+        case NOT:
+        case PUSH:
+        case POP:
+            check_reg(addr, reg_dst(code[addr + 1]));
+            break;
+        case RET:
+            leader[addr + len] = true;
+            break;
+        default:
+            targets.push_back({ addr, imm64u(code[addr + 1]) });
+            leader[addr + len] = true;
+            break;
+        }
+
+        addr += len;
+    }
+
+    for (const auto& [from, to] : targets) {
+        if (to >= prog_size || !boundary[to]) {
+            VERIFY_ERR(from, "target " << HEX_0(to) << " is not an instruction boundary." << endl);
+            continue;
+        }
+        leader[to] = true;
+    }
+
+    if (errors == 0 && (vm_flags & (VM_STATS | VM_FUEL))) {
+        leader[0] = true;
+        for (uint64_t a = 0; a < prog_size; a++) {
+            if (!boundary[a])
+                continue;
+            instr_addrs.push_back(a);
+            if (leader[a])
+                block_addrs.push_back(a);
+        }
+    }
+    if (errors == 0 && (vm_flags & VM_STATS))
+        exec_counts.assign(prog_size, 0);
+    if (errors == 0 && (vm_flags & (VM_PROFILE | VM_CALL_GRAPH))) {
+        for (const auto& [from, to] : targets) {
+            if (instr(code[from]) != CALL)
+                continue;
+            call_targets.push_back(to);
+            return_sites.push_back(from + 9);
+        }
+        std::sort(call_targets.begin(), call_targets.end());
+        call_targets.erase(std::unique(call_targets.begin(), call_targets.end()), call_targets.end());
+    }
+
+    return errors == 0;
+}
+
+
+void ExecutionEngine::expand_block_counts(const uint64_t* block_counts)
+{
+    size_t b = 0;
+    for (uint64_t a : instr_addrs) {
+        while (b + 1 < block_addrs.size() && block_addrs[b + 1] <= a)
+            b++;
+        exec_counts[a] = block_counts[b];
+    }
+}
+
+
+uint8_t* ExecutionEngine::map_guarded(size_t size, int prot, int flags) const
+{
+    uint8_t* base = (uint8_t*) mmap(nullptr, size + 2 * GUARD_SIZE, PROT_NONE, flags | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return nullptr;
+    uint8_t* mem = (uint8_t*) mmap(base + GUARD_SIZE, size, prot, flags | MAP_FIXED, -1, 0);
+    if (mem == MAP_FAILED) {
+        munmap(base, size + 2 * GUARD_SIZE);
+        return nullptr;
+    }
+    mapped += size;
+    peak_mapped = std::max(peak_mapped, mapped);
+    guarded.push_back({ mem, size });
+    return mem;
+}
+
+
+void ExecutionEngine::unmap_guarded(uint8_t* mem, size_t size) const
+{
+    if (munmap(mem - GUARD_SIZE, size + 2 * GUARD_SIZE) != 0)
+        ABORT("Failed to deallocate VM memory." << endl);
+    mapped -= size;
+    guarded.erase(std::find(guarded.begin(), guarded.end(), std::make_pair((const uint8_t*) mem, size)));
+}
+
+
+void ExecutionEngine::load_labels()
+{
+    labels.clear();
+    function_labels.clear();
+    if (labels_file.empty())
+        return;
+
+    std::ifstream lf(labels_file);
+    if (!lf.is_open()) {
+        ERR("Failed to open labels file '" << labels_file << "'." << endl);
+        return;
+    }
+
+    // Lines of '<hex address> <label>', sorted by address; the labels at
+    // an address are listed in the order they were defined.
+    std::string line, top;
+    while (std::getline(lf, line)) {
+        std::istringstream fields(line);
+        uint64_t addr;
+        std::string label;
+        if (!(fields >> std::hex >> addr >> label))
+            continue;
+        if (label[0] != '.') {
+            top = label;
+            if (function_labels.empty() || function_labels.back() != addr)
+                function_labels.push_back(addr);
+        } else {
+            label = top + label;
+        }
+        labels.emplace(addr, label);
+    }
+    DBG("	" << labels.size() << " labels from '" << labels_file << "'" << endl);
+}
+
+
+std::string ExecutionEngine::label_of(uint64_t addr) const
+{
+    std::ostringstream name;
+    auto l = labels.upper_bound(addr);
+    if (l == labels.begin()) {
+        name << HEX_0(addr);
+    } else {
+        --l;
+        name << l->second;
+        if (addr != l->first)
+            name << "+" << HEX_0(addr - l->first);
+    }
+    return name.str();
+}
+
+
+vm_status_t ExecutionEngine::exec_trapping_faults()
+{
+    install_fault_handlers();
+
+    // The fault may be a stack overflow, so the handler needs its own stack.
+    std::unique_ptr<uint8_t[]> alt_stack(new uint8_t[ALT_STACK_SIZE]);
+    stack_t ss = {}, prev_ss;
+    ss.ss_sp = alt_stack.get();
+    ss.ss_size = ALT_STACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, &prev_ss) != 0)
+        ABORT("Failed to install the fault handler stack." << endl);
+
+    vm_status_t status = VM_OK;
+    trapping_engine = this;
+    if (sigsetjmp(fault_env, 1) == 0) {
+        if (!exec_program())
+            status = VM_OUT_OF_FUEL;
+    } else if (fault.sig == 0) {
+        status = raised_status;
+    } else {
+        status = VM_FAULT;
+        fault_pc = fault_vm_pc(fault);
+        fault_addr = fault_vm_addr(fault);
+        ERR("VM fault (" << (fault.sig == SIGBUS ? "SIGBUS" : "SIGSEGV") << ")");
+        if (fault_pc != UNKNOWN_ADDR)
+            ERR_(" at " << HEX_0(fault_pc));
+        ERR_("." << endl);
+        // Data addresses are host addresses in JIT code, offsets in the
+        // interpreter; only the result tells which it faulted on.
+        if (fault_addr != UNKNOWN_ADDR)
+            DBG("\taccessing " << HEX_0(fault_addr) << endl);
+    }
+    trapping_engine = nullptr;
+
+    sigaltstack(&prev_ss, nullptr);
+    return status;
+}
+
+
+void ExecutionEngine::fill_result(vm_status_t status, vm_result_t& result) const
+{
+    result = {};
+    result.status = status;
+    result.fault_pc = fault_pc;
+    result.fault_addr = fault_addr;
+
+    if (!(vm_flags & VM_STATS) || status == VM_INVALID)
+        return;
+
+    const uint8_t* code = (const uint8_t*) prog;
+    for (uint64_t a : instr_addrs) {
+        result.stats.instructions += exec_counts[a];
+        result.stats.opcodes[instr(code[a])] += exec_counts[a];
+    }
+
+    result.stats.num_blocks = block_addrs.size();
+    result.stats.blocks = new vm_block_stats_t[block_addrs.size()];
+    for (size_t b = 0; b < block_addrs.size(); b++)
+        result.stats.blocks[b] = { block_addrs[b], exec_counts[block_addrs[b]] };
+
+    result.stats.num_fusions = fusion_counts.size();
+    result.stats.fusions = new vm_fusion_stats_t[fusion_counts.size()];
+    std::copy(fusion_counts.begin(), fusion_counts.end(), result.stats.fusions);
+}
+
+
+void ExecutionEngine::install_fault_handlers()
+{
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction sa = {};
+        sa.sa_sigaction = trap_fault;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGSEGV, &sa, &prev_sigsegv_action) != 0 || sigaction(SIGBUS, &sa, &prev_sigbus_action) != 0)
+            ABORT("Failed to install the fault handlers." << endl);
+    });
+}
+
+
+void ExecutionEngine::raise_fault(vm_status_t status, uint64_t vm_pc)
+{
+    // The engine running the program may not be the one raising, as with
+    // TieredEngine.
+    ExecutionEngine* engine = trapping_engine;
+    if (engine == nullptr)
+        ABORT("Internal error. Fault raised outside of a run." << endl);
+
+    engine->fault = { 0, 0, 0 };
+    engine->raised_status = status;
+    engine->fault_pc = vm_pc;
+    engine->fault_addr = UNKNOWN_ADDR;
+    siglongjmp(engine->fault_env, 1);
+}
+
+
+bool ExecutionEngine::owns_fault(const fault_t& fault) const
+{
+    for (const auto& [mem, size] : guarded)
+        if (fault.host_addr - ((uint64_t) mem - GUARD_SIZE) < size + 2 * GUARD_SIZE)
+            return true;
+    return false;
+}
+
+
+void ExecutionEngine::trap_fault(int sig, siginfo_t* info, void* ctx)
+{
+    ExecutionEngine* engine = trapping_engine;
+    fault_t fault = { sig, context_pc(ctx), (uint64_t) info->si_addr };
+    if (engine == nullptr || !engine->owns_fault(fault)) {
+        // Not ours, or a fault in host code; hand it to whoever was there
+        // before.
+        const struct sigaction& prev = sig == SIGSEGV ? prev_sigsegv_action : prev_sigbus_action;
+        if (prev.sa_flags & SA_SIGINFO) {
+            prev.sa_sigaction(sig, info, ctx);
+        } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+            prev.sa_handler(sig);
+        } else {
+            signal(sig, SIG_DFL);
+        }
+        return;
+    }
+
+    engine->fault = fault;
+    siglongjmp(engine->fault_env, 1);
+}
+
+
+uint64_t ExecutionEngine::context_pc(const void* ctx)
+{
+    const ucontext_t* uc = (const ucontext_t*) ctx;
+#if defined(__APPLE__) && defined(__x86_64__)
+    return uc->uc_mcontext->__ss.__rip;
+#elif defined(__APPLE__) && defined(__aarch64__)
+    return uc->uc_mcontext->__ss.__pc;
+#elif defined(__linux__) && defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__aarch64__)
+    return uc->uc_mcontext.pc;
+#else
+    (void) uc;
+    return UNKNOWN_ADDR;
+#endif
+}
@@ -1,17 +1,28 @@
 #pragma once
 
 
+#include <csetjmp>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include "vm.h"
 
 
 using std::cout, std:: endl;
 
 
+class Profiler;
+class CallGraph;
+
+
 #define DBG_(DATA) { if (debug) { cout << DATA; } }
 #define DBG(DATA) DBG_("[DEBUG] " << DATA)
 
@@ -33,27 +44,102 @@ using std::cout, std:: endl;
 
 class ExecutionEngine {
 protected:
+    friend class Profiler;
+    friend class CallGraph;
+
     const void* prog;
     size_t prog_size;
     size_t mem_size;
+    uint32_t vm_flags;
     bool debug;
 
+    typedef struct {
+        int         sig;
+        uint64_t    host_pc;
+        uint64_t    host_addr;
+    } fault_t;
+
     virtual void init_execution() = 0;
     virtual void load_program() = 0;
-    virtual void exec_program() = 0;
+    // Returns false if the program ran out of fuel before exiting.
+    virtual bool exec_program() = 0;
     virtual void fini_execution() = 0;
 
+    /* Whether a SIGSEGV or SIGBUS while the program runs is the program's
+     * to take the blame for; any other goes on to whatever handled it before.
+     * By default, only faults on memory mapped by map_guarded(), its guard
+     * pages included, are.
+     */
+    virtual bool owns_fault(const fault_t& fault) const;
+    virtual uint64_t fault_vm_pc(const fault_t& fault) const = 0;
+    virtual uint64_t fault_vm_addr(const fault_t& fault) const = 0;
+    // Ends the run with status at vm_pc, the way a trapped fault does, for
+    // what the program does wrong that traps nothing; the caller says why.
+    [[noreturn]] static void raise_fault(vm_status_t status, uint64_t vm_pc);
+
+    // Fills exec_counts; only called with VM_STATS, before fini_execution().
+    virtual void collect_stats() = 0;
+
+    // The size of the code the program runs as, for the phase statistics;
+    // called before fini_execution().
+    virtual size_t code_size() const = 0;
+    // The most bytes mapped by map_guarded() at once, for the same.
+    virtual size_t peak_mapped_size() const         { return peak_mapped; }
+
+    /* For the sampling profiler, with VM_PROFILE. sample() runs in its
+     * signal handler, on the thread running the program, so it must neither
+     * allocate nor lock. It tells where the program is, in whatever terms
+     * sampled_vm_addr() takes, and where the VM stack is, from the top down;
+     * the return addresses on it fall in [ret_lo, ret_hi). After the run,
+     * sampled_vm_addr() maps both back to VM addresses, or UNKNOWN_ADDR.
+     */
+    typedef struct {
+        uint64_t        pc;
+        const uint64_t* sp;
+        const uint64_t* stack_end;
+        uint64_t        ret_lo, ret_hi;
+    } sample_t;
+
+    virtual void sample(const void* ctx, sample_t& s) const = 0;
+    virtual uint64_t sampled_vm_addr(uint64_t addr) = 0;
+
+    // The host PC in a signal context.
+    static uint64_t context_pc(const void* ctx);
+
+    // Where engines report calls and returns to, with VM_CALL_GRAPH; the
+    // engine run() is called on owns it, TieredEngine shares it.
+    CallGraph* call_graph;
+
+    /* Budget for the current run() with VM_FUEL, 0 meaning unlimited. What a
+     * unit buys is up to the engine: the interpreter charges one per taken
+     * back-edge or call, the JITs one per basic block entered.
+     */
+    uint64_t fuel;
+
 public:
-    ExecutionEngine(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug);
+    ExecutionEngine(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
     virtual ~ExecutionEngine();
 
-    virtual void execute() final {
-        init_execution();
-        load_program();
-        exec_program();
-        fini_execution();
+    /* Runs the program to completion or, with VM_FUEL, until the budget is
+     * spent; VM_OUT_OF_FUEL keeps the whole VM state for the next call. Once
+     * the program has finished, further calls just report how it ended.
+     */
+    virtual vm_status_t run(uint64_t fuel, vm_result_t* result) final;
+    // Releases the VM state of a program that has not finished.
+    virtual void stop() final;
+
+    virtual vm_status_t execute(vm_result_t* result) final {
+        vm_status_t status = run(0, result);
+        stop();
+        return status;
     }
 
+    // Filled in as the program goes through each phase.
+    const vm_phase_stats_t& get_phase_stats() const { return phase_stats; }
+
+    // Where names for VM addresses come from; empty for nowhere.
+    static void set_labels_file(const char* file)   { labels_file = file != nullptr ? file : ""; }
+
 protected:
     typedef enum : uint8_t {
         LOAD        =  1,
@@ -141,4 +227,76 @@ protected:
     } instr_decode_data_t;
 
     void trace_instr_decode(const void* mem, const instr_decode_data_t& idd) const;
+
+    bool verify_program();
+
+    /* Basic blocks, only populated with VM_STATS or VM_FUEL. Blocks start at
+     * address 0, at every branch or call target and after every control
+     * transfer; instr_addrs holds the address of every instruction, in order.
+     * For statistics, engines count either per instruction, straight into
+     * exec_counts, or per block, expanded by expand_block_counts().
+     */
+    std::vector<uint64_t> block_addrs;
+    std::vector<uint64_t> instr_addrs;
+    std::vector<uint64_t> exec_counts;
+    // Per superinstruction, from engines that fuse instructions.
+    std::vector<vm_fusion_stats_t> fusion_counts;
+
+    // Where calls lead and where they return to, in address order; only
+    // populated with VM_PROFILE or VM_CALL_GRAPH.
+    std::vector<uint64_t> call_targets;
+    std::vector<uint64_t> return_sites;
+
+    void expand_block_counts(const uint64_t* block_counts);
+
+    // Large enough for any imm16 displacement off a base inside the mapping.
+    static constexpr size_t GUARD_SIZE              = 64 << 10;
+    static constexpr uint64_t UNKNOWN_ADDR          = (uint64_t) -1;
+
+    uint8_t* map_guarded(size_t size, int prot, int flags) const;
+    void unmap_guarded(uint8_t* mem, size_t size) const;
+    mutable size_t mapped, peak_mapped;
+    mutable std::vector<std::pair<const uint8_t*, size_t>> guarded;
+
+    /* VM addresses named after the labels file tools/asm.py -l writes, by
+     * load_labels(). Local labels are qualified with the label they follow,
+     * as in 'main.loop'; an address past a label is named by an offset from
+     * it, and one before any label by the address itself. function_labels
+     * holds the addresses of the labels that are not local, in order.
+     */
+    static std::string labels_file;
+    std::map<uint64_t, std::string> labels;
+    std::vector<uint64_t> function_labels;
+
+    void load_labels();
+    std::string label_of(uint64_t addr) const;
+
+private:
+    static constexpr size_t ALT_STACK_SIZE          = 64 << 10;
+
+    typedef enum : uint8_t {
+        NOT_STARTED,
+        SUSPENDED,
+        FINISHED,
+    } run_state_t;
+
+    run_state_t run_state;
+    vm_status_t final_status;
+
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<CallGraph> own_call_graph;
+
+    vm_phase_stats_t phase_stats;
+
+    sigjmp_buf fault_env;
+    fault_t fault;
+    uint64_t fault_pc, fault_addr;
+    vm_status_t raised_status;
+
+    void finish(vm_status_t status);
+    void print_phase_stats(vm_status_t status) const;
+    vm_status_t exec_trapping_faults();
+    void fill_result(vm_status_t status, vm_result_t& result) const;
+    static void install_fault_handlers();
+    static void trap_fault(int sig, siginfo_t* info, void* ctx);
 };
@@ -1,22 +1,162 @@
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <sys/mman.h>
 
+#include "vm.h"
 #include "exe.h"
 #include "int.h"
+#include "cg.h"
 
 
-#define DISPATCH(OFFSET) { \
-    reg[PC] += OFFSET; \
-    goto *instr_exec_handle[instr(mem[reg[PC]])]; \
+#define DISPATCH(NEXT) { \
+    ip = (NEXT); \
+    COUNT(); \
+    PUBLISH(); \
+    goto *ip->handler; \
 }
 
-#define TRACE() if (debug) { idd.addr = reg[PC]; trace_instr_decode(mem, idd); }
+#define COUNT() if constexpr (STATS) { stat_hits[ip - decoded.data()]++; }
 
+#define PUBLISH() if constexpr (PROFILING) { \
+    sample_ip.store(ip, std::memory_order_relaxed); \
+    sample_sp.store(sp, std::memory_order_relaxed); \
+}
+
+#define ENTER(TARGET) if constexpr (CALLS) { \
+    HOST_CODE(); \
+    if ((TARGET)->addr != SYS_ENTER_ADDR) \
+        call_graph->enter((TARGET)->addr, sp); \
+}
+#define LEAVE() if constexpr (CALLS) { \
+    HOST_CODE(); \
+    call_graph->leave(sp); \
+}
+
+#define TRACE_AT(DI) if constexpr (TRACING) { \
+    HOST_CODE(); \
+    trace_instr_decode(mem, as_idd(*(DI))); \
+}
+#define TRACE() TRACE_AT(ip)
 
-Interpreter::Interpreter(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
-: ExecutionEngine(prog, prog_size, mem_size_mb, debug)
+#define SYNC_OUT() { \
+    reg[SP] = (uintptr_t) sp - data; \
+    reg[FLAGS] = FLAGS_BITS(); \
+    reg[PC] = ip->addr; \
+}
+#define SYNC_IN() { \
+    sp = (uint8_t*) (data + reg[SP]); \
+    flags = reg[FLAGS]; \
+    lazy_flags = false; \
+}
+
+#define CMP(LHS, RHS) { \
+    cmp_lhs = (LHS); \
+    cmp_rhs = (RHS); \
+    lazy_flags = true; \
+}
+
+#define FLAGS_EQ() (lazy_flags ? cmp_lhs == cmp_rhs : (flags & FLAG_EQ) != 0)
+#define FLAGS_GT() (lazy_flags ? cmp_lhs >  cmp_rhs : (flags & FLAG_GT) != 0)
+#define FLAGS_LT() (lazy_flags ? cmp_lhs <  cmp_rhs : (flags & FLAG_LT) != 0)
+#define FLAGS_GE() (lazy_flags ? cmp_lhs >= cmp_rhs : (flags & (FLAG_GT | FLAG_EQ)) != 0)
+#define FLAGS_LE() (lazy_flags ? cmp_lhs <= cmp_rhs : (flags & (FLAG_LT | FLAG_EQ)) != 0)
+#define FLAGS_BITS() ( \
+    !lazy_flags ? flags : \
+    cmp_lhs < cmp_rhs ? FLAG_LT : cmp_lhs > cmp_rhs ? FLAG_GT : FLAG_EQ \
+)
+
+#define PUSH(VAL) { \
+    sp -= 8; \
+    as_dword(*sp) = (VAL); \
+}
+#define POP(VAL) { \
+    (VAL) = as_dword(*sp); \
+    sp += 8; \
+}
+
+#define DATA(ADDR) (*(uint8_t*) (data + (ADDR)))
+
+/* A store before every access to VM memory, as the signal context cannot
+ * tell the record: the host PC only gives the handler, and ip lives in
+ * whichever register, or stack slot, the compiler picks for it.
+ */
+#define FAULT_AT(DI) { \
+    fault_ip = (DI); \
+    std::atomic_signal_fence(std::memory_order_seq_cst); \
+}
+#define FAULT_POINT() FAULT_AT(ip)
+#define HOST_CODE() FAULT_AT(nullptr)
+
+#define CHECKPOINT(NEXT) { \
+    if (--fuel_left < 0) { \
+        ip = (NEXT); \
+        goto _out_of_fuel; \
+    } \
+}
+#define BACK_EDGE(JMP) if ((JMP)->target <= (JMP)) CHECKPOINT((JMP)->target)
+
+#define FUSED_CMP_JMP(LABEL, RHS, COND) \
+    LABEL: { \
+        TRACE(); \
+        CMP(as_signed(reg[ip->dst]), RHS); \
+        TRACE_AT(ip + 1); \
+        if (COND) { \
+            BACK_EDGE(ip + 1); \
+            DISPATCH((ip + 1)->target); \
+        } else { \
+            DISPATCH(ip + 2); \
+        } \
+    }
+
+#define GUARD_TEXT_WRITE(PTR, NEXT) { \
+    if ((PTR) < text_end) { \
+        uint64_t next_addr = (NEXT); \
+        HOST_CODE(); \
+        decode_written((PTR) - mem, sizeof(uint64_t)); \
+        DISPATCH(at(next_addr)); \
+    } \
+}
+
+
+/* Superinstructions, matched in order at every decoded instruction; the first
+ * match wins, so longer sequences go first. Only the leading record is
+ * rewritten: the others keep their own handlers, so jumps into the middle of
+ * a sequence still work.
+ */
+const Interpreter::fusion_t Interpreter::fusions[] = {
+    { "add+push+load+push+ret", H_EPILOGUE,         5, { H_ADD_SP_IMM, H_PUSH, H_LOAD_SP, H_PUSH, H_RET }    },
+    { "cmp+jmpeq",              H_CMP_REG_JMPEQ,    2, { H_CMP_REG, H_JMPEQ }                                },
+    { "cmp+jmpne",              H_CMP_REG_JMPNE,    2, { H_CMP_REG, H_JMPNE }                                },
+    { "cmp+jmpgt",              H_CMP_REG_JMPGT,    2, { H_CMP_REG, H_JMPGT }                                },
+    { "cmp+jmplt",              H_CMP_REG_JMPLT,    2, { H_CMP_REG, H_JMPLT }                                },
+    { "cmp+jmpge",              H_CMP_REG_JMPGE,    2, { H_CMP_REG, H_JMPGE }                                },
+    { "cmp+jmple",              H_CMP_REG_JMPLE,    2, { H_CMP_REG, H_JMPLE }                                },
+    { "cmp imm+jmpeq",          H_CMP_IMM_JMPEQ,    2, { H_CMP_IMM, H_JMPEQ }                                },
+    { "cmp imm+jmpne",          H_CMP_IMM_JMPNE,    2, { H_CMP_IMM, H_JMPNE }                                },
+    { "cmp imm+jmpgt",          H_CMP_IMM_JMPGT,    2, { H_CMP_IMM, H_JMPGT }                                },
+    { "cmp imm+jmplt",          H_CMP_IMM_JMPLT,    2, { H_CMP_IMM, H_JMPLT }                                },
+    { "cmp imm+jmpge",          H_CMP_IMM_JMPGE,    2, { H_CMP_IMM, H_JMPGE }                                },
+    { "cmp imm+jmple",          H_CMP_IMM_JMPLE,    2, { H_CMP_IMM, H_JMPLE }                                },
+    { "mov imm+push",           H_MOV_IMM_PUSH,     2, { H_MOV_IMM, H_PUSH }                                 },
+    { "push+call",              H_PUSH_CALL,        2, { H_PUSH, H_CALL }                                    },
+    { "load+sub imm",           H_LOAD_SUB_IMM,     2, { H_LOAD, H_SUB_IMM }                                 },
+    { "load sp+sub imm",        H_LOAD_SP_SUB_IMM,  2, { H_LOAD_SP, H_SUB_IMM }                              },
+};
+
+
+Interpreter::Interpreter(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: ExecutionEngine(prog, prog_size, mem_size_mb, vm_flags, debug)
 , mem(nullptr)
+, data_base(0), ret_base(0)
+, exec_handlers(nullptr)
+, fault_ip(nullptr)
+, sample_ip(nullptr), sample_sp(nullptr), stack_end(nullptr)
 {
+    std::memset(&fusion_sites, 0, sizeof fusion_sites);
+    if (vm_flags & VM_STATS)
+        fusion_hits.assign(NUM_FUSIONS, 0);
+
     DBG("\ttype 'interpreter'" << endl);
 }
 
@@ -24,8 +164,18 @@ Interpreter::Interpreter(const void* prog, size_t prog_size, size_t mem_size_mb,
 void Interpreter::init_execution()
 {
     DBG("Initializing memory ..." << endl);
-    mem = new uint8_t[mem_size];
+    // Reserve only; pages are committed on first touch. Accesses that run
+    // off either end, including stack underflow, hit a guard page.
+    mem = map_guarded(mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    if (mem == nullptr)
+        ABORT("Failed to allocate VM memory." << endl);
+#ifdef MADV_HUGEPAGE
+    if (vm_flags & VM_HUGE_PAGES)
+        if (madvise(mem, mem_size, MADV_HUGEPAGE) != 0)
+            DBG("\tHuge pages not available" << endl);
+#endif
     DBG("\tMemory @" << (void*) mem << "[" << HEX(0, mem_size) << "]" << endl);
+    data_base = (uintptr_t) mem;
 
     DBG("Initializing registers ..." << endl);
     std::memset(&reg, 0, sizeof reg);
@@ -38,28 +188,62 @@ void Interpreter::load_program()
 {
     DBG("Loading program ..." << endl);
     std::memmove(mem, prog, prog_size);
+    stack_end = (const uint8_t*) (data_base + reg[SP]);
+
+    DBG("Decoding program ..." << endl);
+    decode_program();
+    DBG("\t" << decoded_idx[prog_size] << " instructions" << endl);
 }
 
 
-void Interpreter::exec_program()
+bool Interpreter::exec_program()
 {
     if (prog_size <= reg[PC])
-        return;
+        return true;
 
     DBG("Running program ..." << endl);
 
+    // Tracing is slow enough as it is not to be profiled, or timed.
+    bool stats = vm_flags & VM_STATS;
+    bool profiling = vm_flags & VM_PROFILE;
+    bool calls = call_graph != nullptr;
+    if (debug)
+        return stats ? exec_decoded<true, true, false, false>() : exec_decoded<true, false, false, false>();
+    else if (profiling && calls)
+        return stats ? exec_decoded<false, true, true, true>() : exec_decoded<false, false, true, true>();
+    else if (profiling)
+        return stats ? exec_decoded<false, true, true, false>() : exec_decoded<false, false, true, false>();
+    else if (calls)
+        return stats ? exec_decoded<false, true, false, true>() : exec_decoded<false, false, false, true>();
+    else
+        return stats ? exec_decoded<false, true, false, false>() : exec_decoded<false, false, false, false>();
+}
+
+
+template <bool TRACING, bool STATS, bool PROFILING, bool CALLS>
+bool Interpreter::exec_decoded()
+{
     static void* instr_exec_handle[] = {
-        nullptr,
+        &&_runaway,
+        &&_bad_jump,
+        &&_invalid,
         &&_load,
         &&_store,
-        &&_mov,
-        &&_add,
-        &&_sub,
-        &&_and,
-        &&_or,
-        &&_xor,
+        &&_mov_reg,
+        &&_mov_imm,
+        &&_add_reg,
+        &&_add_imm,
+        &&_sub_reg,
+        &&_sub_imm,
+        &&_and_reg,
+        &&_and_imm,
+        &&_or_reg,
+        &&_or_imm,
+        &&_xor_reg,
+        &&_xor_imm,
         &&_not,
-        &&_cmp,
+        &&_cmp_reg,
+        &&_cmp_imm,
         &&_push,
         &&_pop,
         &&_call,
@@ -71,315 +255,946 @@ void Interpreter::exec_program()
         &&_jmplt,
         &&_jmpge,
         &&_jmple,
+        &&_sys_enter,
+        &&_load_sp,
+        &&_store_sp,
+        &&_add_sp_imm,
+        &&_sub_sp_imm,
+        &&_slow,
+        &&_cmp_reg_jmpeq,
+        &&_cmp_reg_jmpne,
+        &&_cmp_reg_jmpgt,
+        &&_cmp_reg_jmplt,
+        &&_cmp_reg_jmpge,
+        &&_cmp_reg_jmple,
+        &&_cmp_imm_jmpeq,
+        &&_cmp_imm_jmpne,
+        &&_cmp_imm_jmpgt,
+        &&_cmp_imm_jmplt,
+        &&_cmp_imm_jmpge,
+        &&_cmp_imm_jmple,
+        &&_mov_imm_push,
+        &&_push_call,
+        &&_load_sub_imm,
+        &&_load_sp_sub_imm,
+        &&_epilogue,
     };
 
-    instr_decode_data_t idd = { 0, 0, 0, 0, 0, 0, 0 };
+    // Records keep their handlers across runs, and decode_program() binds
+    // the ones it makes; only a run on another instantiation rebinds them.
+    if (exec_handlers != instr_exec_handle) {
+        exec_handlers = instr_exec_handle;
+        for (auto& di : decoded)
+            di.handler = exec_handlers[di.hid];
+    }
+
+    /* The hottest VM state lives in locals for the whole loop: PC is the
+     * decoded record pointer, SP a host pointer into mem, FLAGS a plain value.
+     * reg[PC], reg[SP] and reg[FLAGS] are only written back by SYNC_OUT() at
+     * syscalls, slow-path instructions and exit. Handlers never see SP,
+     * FLAGS or PC as reg[] operands; decode routes those to the dedicated
+     * _*_sp handlers or to _slow.
+     *
+     * FLAGS is lazy: cmp only records its operands and the conditional jumps
+     * compare them directly. The EQ/LT/GT bits are built by SYNC_OUT() when
+     * something outside the loop may observe them. Until the first cmp, and
+     * after any SYNC_IN(), the raw bits in flags are used instead.
+     *
+     * With STATS, every dispatched record bumps its slot in stat_hits; a
+     * fused record stands for all of its constituents. fold_stats() turns
+     * the hits into per-address counts before each re-decode and at exit.
+     * With CALLS, calls other than syscalls and every ret are reported to
+     * call_graph, with sp at the return address.
+     *
+     * Data addresses are relative to data; calls push ret_base plus the VM
+     * return address and ret takes it off again. Both bases are what
+     * tiered execution changes; otherwise data is mem and ret_base 0.
+     *
+     * Taken back-edges and calls each cost one unit of fuel. Without a
+     * budget fuel_left starts out too large to ever run dry. When it does,
+     * the state is synced out with PC at the branch target, so the next run
+     * picks up from there.
+     */
+    const uintptr_t data = data_base;
+    HOST_CODE();
+    const decoded_instr_t* ip = at(reg[PC]);
+    uint8_t* sp = (uint8_t*) (data + reg[SP]);
+    uint64_t flags = reg[FLAGS];
+    int64_t cmp_lhs = 0, cmp_rhs = 0;
+    bool lazy_flags = false;
+    // Text is only writable while data addresses are offsets into mem.
+    const uint8_t* const text_end = data == (uintptr_t) mem ? mem + prog_size : nullptr;
+    int64_t fuel_left = (vm_flags & VM_FUEL) && fuel != 0 && fuel < (uint64_t) INT64_MAX ? fuel : INT64_MAX;
 
-    DISPATCH(+0);
+    DISPATCH(ip);
 
     _load: {
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        idd.src = reg_src(mem[reg[PC] + 1]);
-        idd.idx = imm16s(mem[reg[PC] + 2]);
         TRACE();
-        reg[idd.dst] = as_dword(mem[reg[idd.src] + idd.idx]);
-        DISPATCH(+4);
+        FAULT_POINT();
+        reg[ip->dst] = as_dword(DATA(reg[ip->src] + ip->imm));
+        DISPATCH(ip + 1);
     }
 
     _store: {
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        idd.src = reg_src(mem[reg[PC] + 1]);
-        idd.idx = imm16s(mem[reg[PC] + 2]);
-        TRACE();
-        as_dword(mem[reg[idd.dst] + idd.idx]) = reg[idd.src];
-        DISPATCH(+4);
-    }
-
-    _mov: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            reg[idd.dst] = reg[idd.src];
-            DISPATCH(+2);
-        case IMM:
-            idd.ivs = imm64s(mem[reg[PC] + 2]);
-            TRACE();
-            as_signed(reg[idd.dst]) = idd.ivs;
-            DISPATCH(+10);
-        }
+        TRACE();
+        FAULT_POINT();
+        uint8_t* addr = &DATA(reg[ip->dst] + ip->imm);
+        as_dword(*addr) = reg[ip->src];
+        GUARD_TEXT_WRITE(addr, ip->next);
+        DISPATCH(ip + 1);
     }
 
-    _add: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            as_signed(reg[idd.dst]) += as_signed(reg[idd.src]);
-            DISPATCH(+2);
-        case IMM:
-            idd.ivs = imm64s(mem[reg[PC] + 2]);
-            TRACE();
-            as_signed(reg[idd.dst]) += idd.ivs;
-            DISPATCH(+10);
-        }
+    _mov_reg: {
+        TRACE();
+        reg[ip->dst] = reg[ip->src];
+        DISPATCH(ip + 1);
     }
 
-    _sub: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            as_signed(reg[idd.dst]) -= as_signed(reg[idd.src]);
-            DISPATCH(+2);
-        case IMM:
-            idd.ivs = imm64s(mem[reg[PC] + 2]);
-            TRACE();
-            as_signed(reg[idd.dst]) -= idd.ivs;
-            DISPATCH(+10);
-        }
+    _mov_imm: {
+        TRACE();
+        as_signed(reg[ip->dst]) = ip->imm;
+        DISPATCH(ip + 1);
     }
 
-    _and: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            reg[idd.dst] &= reg[idd.src];
-            DISPATCH(+2);
-        case IMM:
-            idd.ivu = imm64u(mem[reg[PC] + 2]);
-            TRACE();
-            reg[idd.dst] &= idd.ivu;
-            DISPATCH(+10);
-        }
+    _add_reg: {
+        TRACE();
+        as_signed(reg[ip->dst]) += as_signed(reg[ip->src]);
+        DISPATCH(ip + 1);
     }
 
-    _or: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            reg[idd.dst] |= reg[idd.src];
-            DISPATCH(+2);
-        case IMM:
-            idd.ivu = imm64u(mem[reg[PC] + 2]);
-            TRACE();
-            reg[idd.dst] |= idd.ivu;
-            DISPATCH(+10);
-        }
+    _add_imm: {
+        TRACE();
+        as_signed(reg[ip->dst]) += ip->imm;
+        DISPATCH(ip + 1);
     }
 
-    _xor: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            reg[idd.dst] ^= reg[idd.src];
-            DISPATCH(+2);
-        case IMM:
-            idd.ivu = imm64u(mem[reg[PC] + 2]);
-            TRACE();
-            reg[idd.dst] ^= idd.ivu;
-            DISPATCH(+10);
-        }
+    _sub_reg: {
+        TRACE();
+        as_signed(reg[ip->dst]) -= as_signed(reg[ip->src]);
+        DISPATCH(ip + 1);
+    }
+
+    _sub_imm: {
+        TRACE();
+        as_signed(reg[ip->dst]) -= ip->imm;
+        DISPATCH(ip + 1);
+    }
+
+    _and_reg: {
+        TRACE();
+        reg[ip->dst] &= reg[ip->src];
+        DISPATCH(ip + 1);
+    }
+
+    _and_imm: {
+        TRACE();
+        reg[ip->dst] &= ip->imm;
+        DISPATCH(ip + 1);
+    }
+
+    _or_reg: {
+        TRACE();
+        reg[ip->dst] |= reg[ip->src];
+        DISPATCH(ip + 1);
+    }
+
+    _or_imm: {
+        TRACE();
+        reg[ip->dst] |= ip->imm;
+        DISPATCH(ip + 1);
+    }
+
+    _xor_reg: {
+        TRACE();
+        reg[ip->dst] ^= reg[ip->src];
+        DISPATCH(ip + 1);
+    }
+
+    _xor_imm: {
+        TRACE();
+        reg[ip->dst] ^= ip->imm;
+        DISPATCH(ip + 1);
     }
 
     _not: {
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        TRACE();
-        reg[idd.dst] = ~reg[idd.dst];
-        DISPATCH(+2);
-    }
-
-    _cmp: {
-        idd.am = access_mode(mem[reg[PC]]);
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
-        switch (idd.am) {
-        case REG:
-            idd.src = reg_src(mem[reg[PC] + 1]);
-            TRACE();
-            reg[FLAGS] = 0;
-            if (as_signed(reg[idd.dst]) < as_signed(reg[idd.src]))
-                reg[FLAGS] |= FLAG_LT;
-            else if (as_signed(reg[idd.dst]) > as_signed(reg[idd.src]))
-                reg[FLAGS] |= FLAG_GT;
-            else
-                reg[FLAGS] |= FLAG_EQ;
-            DISPATCH(+2);
-        case IMM:
-            idd.ivs = imm64s(mem[reg[PC] + 2]);
-            TRACE();
-            reg[FLAGS] = 0;
-            if (as_signed(reg[idd.dst]) < idd.ivs)
-                reg[FLAGS] |= FLAG_LT;
-            else if (as_signed(reg[idd.dst]) > idd.ivs)
-                reg[FLAGS] |= FLAG_GT;
-            else
-                reg[FLAGS] |= FLAG_EQ;
-            DISPATCH(+10);
-        }
+        TRACE();
+        reg[ip->dst] = ~reg[ip->dst];
+        DISPATCH(ip + 1);
+    }
+
+    _cmp_reg: {
+        TRACE();
+        CMP(as_signed(reg[ip->dst]), as_signed(reg[ip->src]));
+        DISPATCH(ip + 1);
+    }
+
+    _cmp_imm: {
+        TRACE();
+        CMP(as_signed(reg[ip->dst]), ip->imm);
+        DISPATCH(ip + 1);
     }
 
     _push: {
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
         TRACE();
-        reg[SP] -= 8;
-        as_dword(mem[reg[SP]]) = reg[idd.dst];
-        DISPATCH(+2);
+        FAULT_POINT();
+        PUSH(reg[ip->dst]);
+        GUARD_TEXT_WRITE(sp, ip->next);
+        DISPATCH(ip + 1);
     }
 
     _pop: {
-        idd.dst = reg_dst(mem[reg[PC] + 1]);
         TRACE();
-        reg[idd.dst] = as_dword(mem[reg[SP]]);
-        reg[SP] += 8;
-        DISPATCH(+2);
+        FAULT_POINT();
+        POP(reg[ip->dst]);
+        DISPATCH(ip + 1);
     }
 
     _call: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        reg[SP] -= 8;
-        as_dword(mem[reg[SP]]) = reg[PC] + 9;
-        reg[PC] = idd.ivu;
-        DISPATCH(+0);
+        FAULT_POINT();
+        PUSH(ret_base + ip->next);
+        ENTER(ip->target);
+        GUARD_TEXT_WRITE(sp, ip->target->addr);
+        CHECKPOINT(ip->target);
+        DISPATCH(ip->target);
     }
 
     _ret: {
         TRACE();
-        reg[PC] = as_dword(mem[reg[SP]]);
-        reg[SP] += 8;
-        DISPATCH(+0);
+        LEAVE();
+        FAULT_POINT();
+        uint64_t addr;
+        POP(addr);
+        DISPATCH(at(addr - ret_base));
     }
 
     _jmp: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
-        TRACE();
-        switch (reg[PC]) {
-        case SYS_ENTER_ADDR: {
-            uint64_t syscall_id = imm64u(mem[reg[SP] + 8]);
-            switch (syscall_id) {
-            case SYSCALL_VM_EXIT:
-                reg[SP] += 16;
-                return;
-            default:
-                sys_enter();
-                goto _ret;
-            }
-        }
-        default:
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
-        }
+        TRACE();
+        BACK_EDGE(ip);
+        DISPATCH(ip->target);
     }
 
     _jmpeq: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & FLAG_EQ) {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+        if (FLAGS_EQ()) {
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         } else {
-            DISPATCH(+9);
+            DISPATCH(ip + 1);
         }
     }
 
     _jmpne: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & FLAG_EQ) {
-            DISPATCH(+9);
+        if (FLAGS_EQ()) {
+            DISPATCH(ip + 1);
         } else {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         }
     }
 
     _jmpgt: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & FLAG_GT) {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+        if (FLAGS_GT()) {
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         } else {
-            DISPATCH(+9);
+            DISPATCH(ip + 1);
         }
     }
 
     _jmplt: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & FLAG_LT) {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+        if (FLAGS_LT()) {
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         } else {
-            DISPATCH(+9);
+            DISPATCH(ip + 1);
         }
     }
 
     _jmpge: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & (FLAG_GT | FLAG_EQ)) {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+        if (FLAGS_GE()) {
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         } else {
-            DISPATCH(+9);
+            DISPATCH(ip + 1);
         }
     }
 
     _jmple: {
-        idd.ivu = imm64u(mem[reg[PC] + 1]);
         TRACE();
-        if (reg[FLAGS] & (FLAG_LT | FLAG_EQ)) {
-            reg[PC] = idd.ivu;
-            DISPATCH(+0);
+        if (FLAGS_LE()) {
+            BACK_EDGE(ip);
+            DISPATCH(ip->target);
         } else {
-            DISPATCH(+9);
+            DISPATCH(ip + 1);
         }
     }
 
-    ABORT("Runaway interpreter execution." << endl);
+    _sys_enter: {
+        TRACE();
+        FAULT_POINT();
+        uint64_t syscall_id = as_dword(*(sp + 8));
+        switch (syscall_id) {
+        case SYSCALL_VM_EXIT:
+            sp += 16;
+            SYNC_OUT();
+            return true;
+        default:
+            SYNC_OUT();
+            HOST_CODE();
+            sys_enter();
+            SYNC_IN();
+            // A syscall may write the text; the record itself goes with it.
+            if (sp < text_end) {
+                decode_program();
+                ip = at(reg[PC]);
+            }
+            goto _ret;
+        }
+    }
+
+    _load_sp: {
+        TRACE();
+        FAULT_POINT();
+        reg[ip->dst] = as_dword(*(sp + ip->imm));
+        DISPATCH(ip + 1);
+    }
+
+    _store_sp: {
+        TRACE();
+        FAULT_POINT();
+        uint8_t* addr = sp + ip->imm;
+        as_dword(*addr) = reg[ip->src];
+        GUARD_TEXT_WRITE(addr, ip->next);
+        DISPATCH(ip + 1);
+    }
+
+    _add_sp_imm: {
+        TRACE();
+        sp += ip->imm;
+        DISPATCH(ip + 1);
+    }
+
+    _sub_sp_imm: {
+        TRACE();
+        sp -= ip->imm;
+        DISPATCH(ip + 1);
+    }
+
+    _slow: {
+        TRACE();
+        FAULT_POINT();
+        SYNC_OUT();
+        const uint8_t* written = exec_slow(*ip);
+        SYNC_IN();
+        if (written != nullptr)
+            GUARD_TEXT_WRITE(written, ip->next);
+        DISPATCH(ip + 1);
+    }
+
+    FUSED_CMP_JMP(_cmp_reg_jmpeq, as_signed(reg[ip->src]),   FLAGS_EQ());
+    FUSED_CMP_JMP(_cmp_reg_jmpne, as_signed(reg[ip->src]),  !FLAGS_EQ());
+    FUSED_CMP_JMP(_cmp_reg_jmpgt, as_signed(reg[ip->src]),   FLAGS_GT());
+    FUSED_CMP_JMP(_cmp_reg_jmplt, as_signed(reg[ip->src]),   FLAGS_LT());
+    FUSED_CMP_JMP(_cmp_reg_jmpge, as_signed(reg[ip->src]),   FLAGS_GE());
+    FUSED_CMP_JMP(_cmp_reg_jmple, as_signed(reg[ip->src]),   FLAGS_LE());
+    FUSED_CMP_JMP(_cmp_imm_jmpeq, ip->imm,                   FLAGS_EQ());
+    FUSED_CMP_JMP(_cmp_imm_jmpne, ip->imm,                  !FLAGS_EQ());
+    FUSED_CMP_JMP(_cmp_imm_jmpgt, ip->imm,                   FLAGS_GT());
+    FUSED_CMP_JMP(_cmp_imm_jmplt, ip->imm,                   FLAGS_LT());
+    FUSED_CMP_JMP(_cmp_imm_jmpge, ip->imm,                   FLAGS_GE());
+    FUSED_CMP_JMP(_cmp_imm_jmple, ip->imm,                   FLAGS_LE());
+
+    _mov_imm_push: {
+        TRACE();
+        as_signed(reg[ip->dst]) = ip->imm;
+        TRACE_AT(ip + 1);
+        FAULT_AT(ip + 1);
+        PUSH(reg[(ip + 1)->dst]);
+        GUARD_TEXT_WRITE(sp, (ip + 1)->next);
+        DISPATCH(ip + 2);
+    }
+
+    _push_call: {
+        TRACE();
+        FAULT_POINT();
+        PUSH(reg[ip->dst]);
+        GUARD_TEXT_WRITE(sp, ip->next);
+        ip++;
+        TRACE();
+        FAULT_POINT();
+        PUSH(ret_base + ip->next);
+        ENTER(ip->target);
+        GUARD_TEXT_WRITE(sp, ip->target->addr);
+        CHECKPOINT(ip->target);
+        DISPATCH(ip->target);
+    }
+
+    _load_sub_imm: {
+        TRACE();
+        FAULT_POINT();
+        reg[ip->dst] = as_dword(DATA(reg[ip->src] + ip->imm));
+        TRACE_AT(ip + 1);
+        as_signed(reg[(ip + 1)->dst]) -= (ip + 1)->imm;
+        DISPATCH(ip + 2);
+    }
+
+    _load_sp_sub_imm: {
+        TRACE();
+        FAULT_POINT();
+        reg[ip->dst] = as_dword(*(sp + ip->imm));
+        TRACE_AT(ip + 1);
+        as_signed(reg[(ip + 1)->dst]) -= (ip + 1)->imm;
+        DISPATCH(ip + 2);
+    }
+
+    _epilogue: {
+        TRACE();
+        sp += ip->imm;
+        ip++;
+        TRACE();
+        FAULT_POINT();
+        PUSH(reg[ip->dst]);
+        GUARD_TEXT_WRITE(sp, ip->next);
+        ip++;
+        TRACE();
+        FAULT_POINT();
+        reg[ip->dst] = as_dword(*(sp + ip->imm));
+        ip++;
+        TRACE();
+        FAULT_POINT();
+        PUSH(reg[ip->dst]);
+        GUARD_TEXT_WRITE(sp, ip->next);
+        ip++;
+        goto _ret;
+    }
+
+    _out_of_fuel: {
+        SYNC_OUT();
+        return false;
+    }
+
+    _invalid: {
+        HOST_CODE();
+        ERR("Unsupported instruction '" << HEX(2, (int) instr(mem[ip->addr])) << "' at " << HEX_0(ip->addr) << "." << endl);
+        raise_fault(VM_INVALID, ip->addr);
+    }
+
+    _bad_jump: {
+        // Led to by a return, fault_ip is that return.
+        uint64_t pc = ip->imm >= 0 ? ip->imm : fault_ip != nullptr ? fault_ip->addr : UNKNOWN_ADDR;
+        HOST_CODE();
+        ERR("Jump to an address which is not an instruction boundary");
+        if (pc != UNKNOWN_ADDR)
+            ERR_(" at " << HEX_0(pc));
+        ERR_("." << endl);
+        raise_fault(VM_FAULT, pc);
+    }
+
+    _runaway: {
+        HOST_CODE();
+        ERR("Runaway interpreter execution at " << HEX_0(ip->addr) << "." << endl);
+        raise_fault(VM_FAULT, ip->addr);
+    }
+}
+
+
+void Interpreter::decode_program()
+{
+    if (prog_size >= NO_INSTR)
+        ABORT("Program too large to decode." << endl);
+
+    if (!stat_hits.empty())
+        fold_stats();
+
+    // The profiler must not look at records about to go.
+    sample_ip.store(nullptr, std::memory_order_relaxed);
+    decoded.clear();
+    decoded_idx.assign(prog_size + 2, NO_INSTR);
+
+    uint64_t addr = 0;
+    while (addr < prog_size) {
+        decoded_idx[addr] = decoded.size();
+        decoded.push_back(decode_instr(addr));
+        addr = decoded.back().next;
+    }
+
+    decoded_instr_t runaway = {};
+    runaway.hid = H_RUNAWAY;
+    runaway.addr = runaway.next = addr;
+    decoded_idx[prog_size] = decoded.size();
+    decoded.push_back(runaway);
+
+    // Everything else, past the end included, leads to a bad jump record.
+    // Its imm is where the jump is, -1 for a return or anywhere unknown.
+    decoded_instr_t bad_jump = {};
+    bad_jump.hid = H_BAD_JUMP;
+    bad_jump.addr = bad_jump.next = addr;
+    bad_jump.imm = -1;
+    for (auto& idx : decoded_idx)
+        if (idx == NO_INSTR)
+            idx = decoded.size();
+    decoded.push_back(bad_jump);
+
+    // Only rewritten text branches to what is not an instruction; such a
+    // branch gets a bad jump record of its own, so as to tell where it is.
+    std::vector<std::pair<size_t, size_t>> bad_branches;
+    for (size_t i = 0; i < decoded_idx[prog_size]; i++) {
+        if (!is_branch(decoded[i].hid) || at(decoded[i].imm)->hid != H_BAD_JUMP)
+            continue;
+        bad_jump.imm = decoded[i].addr;
+        bad_branches.push_back({ i, decoded.size() });
+        decoded.push_back(bad_jump);
+    }
+
+    for (auto& di : decoded)
+        if (is_branch(di.hid))
+            di.target = at(di.imm);
+    for (const auto& [branch, bad] : bad_branches)
+        decoded[branch].target = &decoded[bad];
+
+    fuse_program();
+
+    if (vm_flags & VM_STATS)
+        stat_hits.assign(decoded.size(), 0);
+
+    if (exec_handlers != nullptr)
+        for (auto& di : decoded)
+            di.handler = exec_handlers[di.hid];
+}
+
+
+Interpreter::decoded_instr_t Interpreter::decode_instr(uint64_t addr) const
+{
+    decoded_instr_t di = {};
+    uint8_t op = mem[addr];
+    uint8_t len;
+
+    di.addr = addr;
+    di.am = access_mode(op);
+    di.dst = reg_dst(mem[addr + 1]);
+    di.src = reg_src(mem[addr + 1]);
+
+    auto alu = [&di, &len, this](handler_id_t h_reg, handler_id_t h_imm) {
+        if (di.am == IMM) {
+            di.hid = h_imm;
+            di.imm = imm64s(mem[di.addr + 2]);
+            len = 10;
+        } else {
+            di.hid = h_reg;
+            len = 2;
+        }
+    };
+    auto branch = [&di, &len, this](handler_id_t h) {
+        di.hid = h;
+        di.imm = imm64u(mem[di.addr + 1]);
+        len = 9;
+    };
+
+    switch (instr(op)) {
+    case LOAD:  di.hid = H_LOAD;  di.imm = imm16s(mem[addr + 2]); len = 4;  break;
+    case STORE: di.hid = H_STORE; di.imm = imm16s(mem[addr + 2]); len = 4;  break;
+    case MOV:   alu(H_MOV_REG, H_MOV_IMM);                                  break;
+    case ADD:   alu(H_ADD_REG, H_ADD_IMM);                                  break;
+    case SUB:   alu(H_SUB_REG, H_SUB_IMM);                                  break;
+    case AND:   alu(H_AND_REG, H_AND_IMM);                                  break;
+    case OR:    alu(H_OR_REG,  H_OR_IMM);                                   break;
+    case XOR:   alu(H_XOR_REG, H_XOR_IMM);                                  break;
+    case NOT:   di.hid = H_NOT;   len = 2;                                  break;
+    case CMP:   alu(H_CMP_REG, H_CMP_IMM);                                  break;
+    case PUSH:  di.hid = H_PUSH;  len = 2;                                  break;
+    case POP:   di.hid = H_POP;   len = 2;                                  break;
+    case CALL:  branch(H_CALL);                                             break;
+    case RET:   di.hid = H_RET;   len = 1;                                  break;
+    case JMP:   branch(addr == SYS_ENTER_ADDR ? H_SYS_ENTER : H_JMP);       break;
+    case JMPEQ: branch(H_JMPEQ);                                            break;
+    case JMPNE: branch(H_JMPNE);                                            break;
+    case JMPGT: branch(H_JMPGT);                                            break;
+    case JMPLT: branch(H_JMPLT);                                            break;
+    case JMPGE: branch(H_JMPGE);                                            break;
+    case JMPLE: branch(H_JMPLE);                                            break;
+    default:    di.hid = H_INVALID; len = 1;                                break;
+    }
+    specialize(di);
+
+    di.next = addr + len;
+    return di;
+}
+
+
+void Interpreter::decode_written(uint64_t addr, size_t size)
+{
+    // The records the write overlaps, up to the one holding its last byte.
+    size_t num_instrs = decoded_idx[prog_size];
+    auto record_at = [this, num_instrs](uint64_t a) {
+        while (decoded_idx[a] >= num_instrs)
+            a--;
+        return (size_t) decoded_idx[a];
+    };
+    size_t first = record_at(addr);
+    size_t last = record_at(std::min<uint64_t>(addr + size, prog_size) - 1);
+
+    /* The records are redone in place as long as the instructions keep their
+     * boundaries, which spares every record elsewhere, and the branches to
+     * them, and the profiler, a move. Anything else, and a branch now to
+     * what is not an instruction, takes redoing the whole program.
+     */
+    std::vector<decoded_instr_t> redone;
+    for (size_t i = first; i <= last; i++) {
+        decoded_instr_t di = decode_instr(decoded[i].addr);
+        if (di.next != decoded[i].next || (is_branch(di.hid) && at(di.imm)->hid == H_BAD_JUMP)) {
+            decode_program();
+            return;
+        }
+        redone.push_back(di);
+    }
+
+    // Fused records as far back as a sequence reaches are matched again.
+    size_t from = first >= MAX_FUSION_LEN - 1 ? first - (MAX_FUSION_LEN - 1) : 0;
+    if (!stat_hits.empty())
+        fold_stats(from, last + 1);
+    for (size_t i = from; i < first; i++)
+        unfuse(decoded[i]);
+    for (size_t i = first; i <= last; i++) {
+        unfuse(decoded[i]);
+        decoded[i] = redone[i - first];
+        if (is_branch(decoded[i].hid))
+            decoded[i].target = at(decoded[i].imm);
+    }
+    for (size_t i = from; i <= last; i++) {
+        fuse_at(i);
+        if (exec_handlers != nullptr)
+            decoded[i].handler = exec_handlers[decoded[i].hid];
+    }
+}
+
+
+void Interpreter::specialize(decoded_instr_t& di) const
+{
+    auto cached = [](uint8_t r) { return r == FLAGS || r == SP || r == PC; };
+
+    bool uses_dst = true, uses_src = false;
+    switch (di.hid) {
+    case H_LOAD:
+        if (di.src == SP && !cached(di.dst)) {
+            di.hid = H_LOAD_SP;
+            return;
+        }
+        uses_src = true;
+        break;
+    case H_STORE:
+        if (di.dst == SP && !cached(di.src)) {
+            di.hid = H_STORE_SP;
+            return;
+        }
+        uses_src = true;
+        break;
+    case H_ADD_IMM:
+        if (di.dst == SP) {
+            di.hid = H_ADD_SP_IMM;
+            return;
+        }
+        break;
+    case H_SUB_IMM:
+        if (di.dst == SP) {
+            di.hid = H_SUB_SP_IMM;
+            return;
+        }
+        break;
+    case H_MOV_REG:
+    case H_ADD_REG:
+    case H_SUB_REG:
+    case H_AND_REG:
+    case H_OR_REG:
+    case H_XOR_REG:
+    case H_CMP_REG:
+        uses_src = true;
+        break;
+    case H_MOV_IMM:
+    case H_AND_IMM:
+    case H_OR_IMM:
+    case H_XOR_IMM:
+    case H_CMP_IMM:
+    case H_NOT:
+    case H_PUSH:
+    case H_POP:
+        break;
+    default:
+        return;
+    }
+
+    if ((uses_dst && cached(di.dst)) || (uses_src && cached(di.src))) {
+        di.slow_hid = di.hid;
+        di.hid = H_SLOW;
+    }
+}
+
+
+void Interpreter::fuse_program()
+{
+    std::memset(&fusion_sites, 0, sizeof fusion_sites);
+
+    for (size_t i = 0; i < decoded_idx[prog_size]; i++)
+        fuse_at(i);
+}
+
+
+void Interpreter::fuse_at(size_t i)
+{
+    size_t num_instrs = decoded_idx[prog_size];
+    for (const auto& f : fusions) {
+        if (i + f.len > num_instrs)
+            continue;
+        size_t k = 0;
+        while (k < f.len && decoded[i + k].hid == f.seq[k])
+            k++;
+        if (k < f.len)
+            continue;
+        decoded[i].hid = f.fused;
+        fusion_sites[f.fused - H_FUSED_FIRST]++;
+        return;
+    }
+}
+
+
+void Interpreter::unfuse(decoded_instr_t& di)
+{
+    if (di.hid < H_FUSED_FIRST || di.hid > H_FUSED_LAST)
+        return;
+    fusion_sites[di.hid - H_FUSED_FIRST]--;
+    di.hid = fusion_of(di.hid).seq[0];
+}
+
+
+const Interpreter::fusion_t& Interpreter::fusion_of(uint8_t hid)
+{
+    for (const auto& f : fusions)
+        if (f.fused == hid)
+            return f;
+    ABORT("Internal error. Unexpected fused handler '" << (int) hid << "'." << endl);
+}
+
+
+bool Interpreter::is_branch(uint8_t hid)
+{
+    switch (hid) {
+    case H_CALL:
+    case H_JMP:
+    case H_JMPEQ:
+    case H_JMPNE:
+    case H_JMPGT:
+    case H_JMPLT:
+    case H_JMPGE:
+    case H_JMPLE:
+    case H_SYS_ENTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+ExecutionEngine::instr_decode_data_t Interpreter::as_idd(const decoded_instr_t& di) const
+{
+    instr_decode_data_t idd = { di.addr, di.am, di.dst, di.src, (int16_t) di.imm, (uint64_t) di.imm, di.imm };
+    switch (di.hid) {
+    case H_CALL:
+    case H_JMP:
+    case H_JMPEQ:
+    case H_JMPNE:
+    case H_JMPGT:
+    case H_JMPLT:
+    case H_JMPGE:
+    case H_JMPLE:
+    case H_SYS_ENTER:
+        idd.ivu = di.target->addr;
+        idd.ivs = di.target->addr;
+        break;
+    default:
+        break;
+    }
+    return idd;
 }
 
 
 void Interpreter::fini_execution()
 {
-    delete[] mem;
+    unmap_guarded(mem, mem_size);
+    mem = nullptr;
     dump_registers();
+    dump_fusions();
+}
+
+
+bool Interpreter::owns_fault(const fault_t& fault) const
+{
+    // Data addresses may be anywhere; any fault while a record accesses
+    // them is the program's, none in the host code it calls out to.
+    return fault_ip != nullptr || ExecutionEngine::owns_fault(fault);
+}
+
+
+uint64_t Interpreter::fault_vm_pc(const fault_t&) const
+{
+    return fault_ip != nullptr ? fault_ip->addr : UNKNOWN_ADDR;
+}
+
+
+uint64_t Interpreter::fault_vm_addr(const fault_t& fault) const
+{
+    return fault.host_addr - data_base;
+}
+
+
+void Interpreter::sample(const void*, sample_t& s) const
+{
+    const decoded_instr_t* ip = sample_ip.load(std::memory_order_relaxed);
+    s.pc = ip != nullptr ? ip->addr : UNKNOWN_ADDR;
+    s.sp = (const uint64_t*) sample_sp.load(std::memory_order_relaxed);
+    s.stack_end = (const uint64_t*) stack_end;
+    s.ret_lo = ret_base;
+    s.ret_hi = ret_base + prog_size;
+}
+
+
+uint64_t Interpreter::sampled_vm_addr(uint64_t addr)
+{
+    // Return addresses are off ret_base, PCs are not; either may be 0.
+    if (addr - ret_base < prog_size)
+        return addr - ret_base;
+    return addr < prog_size ? addr : UNKNOWN_ADDR;
+}
+
+
+void Interpreter::collect_stats()
+{
+    fold_stats();
+
+    fusion_counts.clear();
+    for (const auto& f : fusions) {
+        size_t i = f.fused - H_FUSED_FIRST;
+        fusion_counts.push_back({ f.name, fusion_sites[i], fusion_hits[i] });
+    }
+}
+
+
+void Interpreter::fold_stats(size_t first, size_t last)
+{
+    for (size_t i = first; i < std::min(last, stat_hits.size()); i++) {
+        uint64_t hits = stat_hits[i];
+        if (hits == 0)
+            continue;
+        size_t len = 1;
+        if (decoded[i].hid >= H_FUSED_FIRST && decoded[i].hid <= H_FUSED_LAST) {
+            fusion_hits[decoded[i].hid - H_FUSED_FIRST] += hits;
+            len = fusion_of(decoded[i].hid).len;
+        }
+        for (size_t k = 0; k < len; k++)
+            if (decoded[i + k].addr < prog_size)
+                exec_counts[decoded[i + k].addr] += hits;
+        stat_hits[i] = 0;
+    }
+}
+
+
+const uint8_t* Interpreter::exec_slow(const decoded_instr_t& di)
+{
+    uint64_t& dst = reg[di.dst];
+    uint64_t& src = reg[di.src];
+
+    switch (di.slow_hid) {
+    case H_LOAD:
+        dst = as_dword(*(uint8_t*) (data_base + src + di.imm));
+        break;
+    case H_STORE: {
+        uint8_t* addr = (uint8_t*) (data_base + dst + di.imm);
+        as_dword(*addr) = src;
+        return addr;
+    }
+    case H_MOV_REG:
+        dst = src;
+        break;
+    case H_MOV_IMM:
+        as_signed(dst) = di.imm;
+        break;
+    case H_ADD_REG:
+        as_signed(dst) += as_signed(src);
+        break;
+    case H_ADD_IMM:
+        as_signed(dst) += di.imm;
+        break;
+    case H_SUB_REG:
+        as_signed(dst) -= as_signed(src);
+        break;
+    case H_SUB_IMM:
+        as_signed(dst) -= di.imm;
+        break;
+    case H_AND_REG:
+        dst &= src;
+        break;
+    case H_AND_IMM:
+        dst &= di.imm;
+        break;
+    case H_OR_REG:
+        dst |= src;
+        break;
+    case H_OR_IMM:
+        dst |= di.imm;
+        break;
+    case H_XOR_REG:
+        dst ^= src;
+        break;
+    case H_XOR_IMM:
+        dst ^= di.imm;
+        break;
+    case H_NOT:
+        dst = ~dst;
+        break;
+    case H_CMP_REG:
+    case H_CMP_IMM: {
+        int64_t lhs = as_signed(dst);
+        int64_t rhs = di.slow_hid == H_CMP_IMM ? di.imm : as_signed(src);
+        reg[FLAGS] = lhs < rhs ? FLAG_LT : lhs > rhs ? FLAG_GT : FLAG_EQ;
+        break;
+    }
+    case H_PUSH:
+        reg[SP] -= 8;
+        as_dword(*(uint8_t*) (data_base + reg[SP])) = dst;
+        return (uint8_t*) (data_base + reg[SP]);
+    case H_POP:
+        dst = as_dword(*(uint8_t*) (data_base + reg[SP]));
+        reg[SP] += 8;
+        break;
+    default:
+        ABORT("Internal error. Unexpected slow path handler '" << (int) di.slow_hid << "'." << endl);
+    }
+
+    return nullptr;
 }
 
 
 void Interpreter::sys_enter()
 {
-    uint64_t syscall_id = imm64u(mem[reg[SP] + 8]);
+    uint8_t* sp = (uint8_t*) (data_base + reg[SP]);
+    uint64_t syscall_id = imm64u(sp[8]);
     switch (syscall_id) {
     case SYSCALL_VM_EXIT:
         ABORT("Internal error. SYSCALL_VM_EXIT should not have been handled here." << endl);
     case SYSCALL_DISPLAY_SINT: {
-        int64_t val = imm64s(mem[reg[SP] + 16]);
+        int64_t val = imm64s(sp[16]);
         cout << val << endl;
-        as_dword(mem[reg[SP] + 16]) = as_dword(mem[reg[SP]]);
+        as_dword(sp[16]) = as_dword(sp[0]);
         reg[SP] += 16;
         break;
     }
     case SYSCALL_DISPLAY_UINT: {
-        uint64_t val = imm64u(mem[reg[SP] + 16]);
+        uint64_t val = imm64u(sp[16]);
         cout << val << endl;
-        as_dword(mem[reg[SP] + 16]) = as_dword(mem[reg[SP]]);
+        as_dword(sp[16]) = as_dword(sp[0]);
         reg[SP] += 16;
         break;
     }
@@ -409,3 +1224,17 @@ void Interpreter::dump_registers() const
     DBG("\tSP    = " << HEX(16, reg[SP])    << endl);
     DBG("\tPC    = " << HEX(16, reg[PC])    << endl);
 }
+
+
+void Interpreter::dump_fusions() const
+{
+    DBG("Fusions:" << endl);
+    for (const auto& f : fusions) {
+        size_t i = f.fused - H_FUSED_FIRST;
+        DBG("\t" << std::setw(24) << std::setfill(' ') << std::left << f.name
+            << " sites " << std::setw(fusion_hits.empty() ? 0 : 6) << fusion_sites[i]);
+        if (!fusion_hits.empty())
+            DBG_(" hits " << fusion_hits[i]);
+        DBG_(endl);
+    }
+}
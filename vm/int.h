@@ -1,23 +1,182 @@
 #pragma once
 
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 #include "exe.h"
 
 
 class Interpreter final : public ExecutionEngine {
 public:
-    Interpreter(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug);
+    Interpreter(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
 
 private:
+    friend class TieredEngine;
+
+    typedef enum : uint8_t {
+        H_RUNAWAY           =  0,
+        H_BAD_JUMP          =  1,
+        H_INVALID           =  2,
+        H_LOAD              =  3,
+        H_STORE             =  4,
+        H_MOV_REG           =  5,
+        H_MOV_IMM           =  6,
+        H_ADD_REG           =  7,
+        H_ADD_IMM           =  8,
+        H_SUB_REG           =  9,
+        H_SUB_IMM           = 10,
+        H_AND_REG           = 11,
+        H_AND_IMM           = 12,
+        H_OR_REG            = 13,
+        H_OR_IMM            = 14,
+        H_XOR_REG           = 15,
+        H_XOR_IMM           = 16,
+        H_NOT               = 17,
+        H_CMP_REG           = 18,
+        H_CMP_IMM           = 19,
+        H_PUSH              = 20,
+        H_POP               = 21,
+        H_CALL              = 22,
+        H_RET               = 23,
+        H_JMP               = 24,
+        H_JMPEQ             = 25,
+        H_JMPNE             = 26,
+        H_JMPGT             = 27,
+        H_JMPLT             = 28,
+        H_JMPGE             = 29,
+        H_JMPLE             = 30,
+        H_SYS_ENTER         = 31,
+        H_LOAD_SP           = 32,
+        H_STORE_SP          = 33,
+        H_ADD_SP_IMM        = 34,
+        H_SUB_SP_IMM        = 35,
+        H_SLOW              = 36,
+
+        // Superinstructions
+        H_CMP_REG_JMPEQ     = 37,
+        H_CMP_REG_JMPNE     = 38,
+        H_CMP_REG_JMPGT     = 39,
+        H_CMP_REG_JMPLT     = 40,
+        H_CMP_REG_JMPGE     = 41,
+        H_CMP_REG_JMPLE     = 42,
+        H_CMP_IMM_JMPEQ     = 43,
+        H_CMP_IMM_JMPNE     = 44,
+        H_CMP_IMM_JMPGT     = 45,
+        H_CMP_IMM_JMPLT     = 46,
+        H_CMP_IMM_JMPGE     = 47,
+        H_CMP_IMM_JMPLE     = 48,
+        H_MOV_IMM_PUSH      = 49,
+        H_PUSH_CALL         = 50,
+        H_LOAD_SUB_IMM      = 51,
+        H_LOAD_SP_SUB_IMM   = 52,
+        H_EPILOGUE          = 53,
+
+        H_FUSED_FIRST       = H_CMP_REG_JMPEQ,
+        H_FUSED_LAST        = H_EPILOGUE,
+    } handler_id_t;
+
+    struct alignas(32) decoded_instr_t {
+        void*                                       handler;
+        union {
+            int64_t                                 imm;
+            const decoded_instr_t*                  target;
+        };
+        uint32_t                                    addr;
+        uint32_t                                    next;
+        uint8_t                                     hid;
+        uint8_t                                     slow_hid;
+        uint8_t                                     am;
+        uint8_t                                     dst;
+        uint8_t                                     src;
+    };
+
+    static constexpr uint32_t NO_INSTR              = (uint32_t) -1;
+
+    static constexpr size_t MAX_FUSION_LEN          = 5;
+    static constexpr size_t NUM_FUSIONS             = H_FUSED_LAST - H_FUSED_FIRST + 1;
+
+    typedef struct {
+        const char*                                 name;
+        handler_id_t                                fused;
+        uint8_t                                     len;
+        handler_id_t                                seq[MAX_FUSION_LEN];
+    } fusion_t;
+
+    static const fusion_t                           fusions[NUM_FUSIONS];
+
     uint8_t* mem;
     uint64_t reg[16];
 
+    /* VM data addresses are relative to data_base, mem unless TieredEngine
+     * points them at host memory shared with JIT code. Return addresses on
+     * the VM stack are ret_base plus the VM address returned to.
+     */
+    uintptr_t                                       data_base;
+    uint64_t                                        ret_base;
+
+    std::vector<decoded_instr_t>                    decoded;
+    std::vector<uint32_t>                           decoded_idx;
+    void* const*                                    exec_handlers;
+    // The record accessing VM memory, if any; nullptr while host code runs.
+    const decoded_instr_t*                          fault_ip;
+
+    uint64_t                                        fusion_sites[NUM_FUSIONS];
+    // Only with VM_STATS, folded from stat_hits like exec_counts.
+    std::vector<uint64_t>                           fusion_hits;
+
+    std::vector<uint64_t>                           stat_hits;
+
+    // With VM_PROFILE, every dispatch publishes the record and the stack
+    // pointer for the profiler, as both otherwise live in locals.
+    std::atomic<const decoded_instr_t*>             sample_ip;
+    std::atomic<const uint8_t*>                     sample_sp;
+    const uint8_t*                                  stack_end;
+
     void init_execution() override;
     void load_program() override;
-    void exec_program() override;
+    bool exec_program() override;
     void fini_execution() override;
 
+    bool owns_fault(const fault_t& fault) const override;
+    uint64_t fault_vm_pc(const fault_t& fault) const override;
+    uint64_t fault_vm_addr(const fault_t& fault) const override;
+
+    void collect_stats() override;
+    void fold_stats(size_t first = 0, size_t last = SIZE_MAX);
+    size_t code_size() const override               { return decoded.size() * sizeof(decoded_instr_t); }
+
+    void sample(const void* ctx, sample_t& s) const override;
+    uint64_t sampled_vm_addr(uint64_t addr) override;
+
+    template <bool TRACING, bool STATS, bool PROFILING, bool CALLS>
+    bool exec_decoded();
+
+    void decode_program();
+    decoded_instr_t decode_instr(uint64_t addr) const;
+    // Redoes the records for size bytes of text written at addr.
+    void decode_written(uint64_t addr, size_t size);
+    void fuse_program();
+    void fuse_at(size_t i);
+    void unfuse(decoded_instr_t& di);
+    static const fusion_t& fusion_of(uint8_t hid);
+    static bool is_branch(uint8_t hid);
+    // decoded_idx has an entry for every address up to prog_size, then one
+    // more for all addresses past it.
+    const decoded_instr_t* at(uint64_t addr) const  {
+                                                        return &decoded[
+                                                            decoded_idx[std::min<uint64_t>(addr, decoded_idx.size() - 1)]
+                                                        ];
+                                                    }
+    instr_decode_data_t as_idd(const decoded_instr_t& di) const;
+
+    void specialize(decoded_instr_t& di) const;
+    // Returns where it stored to, if anywhere.
+    const uint8_t* exec_slow(const decoded_instr_t& di);
+
     void sys_enter();
 
     void dump_registers() const;
+    void dump_fusions() const;
 };
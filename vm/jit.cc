@@ -1,22 +1,60 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <fstream>
 #include <map>
+#include <mutex>
+#include <numeric>
 #include <pthread.h>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
+#include "vm.h"
 #include "jit.h"
 
 
-JIT::JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
-: ExecutionEngine(prog, prog_size, mem_size_mb, debug)
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325);
+static void get_cpu_features(uint64_t features[4]);
+static uint64_t perf_timestamp();
+
+
+// Shared by every engine in the process, as the files are.
+static std::mutex perf_lock;
+static FILE* jitdump_file = nullptr;
+static pid_t jitdump_pid = 0;
+static uint64_t jitdump_index = 0;
+
+
+std::string JIT::cache_dir;
+size_t JIT::num_threads = 0;
+
+
+JIT::JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: ExecutionEngine(prog, prog_size, mem_size_mb, vm_flags, debug)
 , text_mem(nullptr), data_mem(nullptr)
 , text_mem_size(mem_size / 4), data_mem_size(mem_size - text_mem_size)
 , jpos({nullptr, (const uint8_t*) prog})
 , sys_enter_stub(nullptr), stack(nullptr)
 , reg_dump_area(new uint64_t[14])
+, block_counters(nullptr), fuel_counter(nullptr), text_limit(nullptr)
+, yield_stub(nullptr), resume_stub(nullptr), suspended(false)
+, tiered(false), ret_pads(nullptr)
+, lazy(false)
+, relocatable(false)
+, owner(this), span_begin(0), span_end(0)
 {
 }
 
@@ -24,27 +62,72 @@ JIT::JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
 void JIT::init_execution()
 {
     init_memory();
-    init_codegen();
+    init_layout();
+    // A tiered JIT sets up its code generator once it starts compiling.
+    if (!tiered)
+        init_codegen();
+    if (vm_flags & (VM_PERF_MAP | VM_JITDUMP))
+        load_labels();
 }
 
 
 void JIT::load_program()
 {
-    jit();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t key = uses_cache() ? cache_key() : 0;
+    bool cached = uses_cache() && load_cached_code(key);
+    if (!cached) {
+        if (!lazy) {
+            build_ir();
+            optimize_ir();
+        }
+        jit();
+        if (!lazy && relax_branches()) {
+            init_codegen();
+            jit();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    DBG("\t" << (cached ? "Loaded code for " : "JITed ") << prog_size << " bytes in " << elapsed.count() * 1e3 << " ms ("
+        << prog_size / elapsed.count() / 1e6 << " MB/s)" << endl);
+    if (jpos.arch > text_limit)
+        ABORT("JIT code overflows into the counters at the end of text memory." << endl);
+    if (debug) {
+        // Code for the VM instructions only; the stubs and the sys_enter
+        // replacement of the instruction at SYS_ENTER_ADDR come first.
+        auto first = std::find_if(va2aa.begin() + SYS_ENTER_ADDR + 1, va2aa.end(), [](uint64_t aa) { return aa != (uint64_t) -1; });
+        size_t code_size = first != va2aa.end() ? (uint64_t) jpos.arch - *first : 0;
+        size_t num_instrs = std::count_if(first, va2aa.end(), [](uint64_t aa) { return aa != (uint64_t) -1; });
+        DBG("\tnative code " << code_size << " bytes for " << num_instrs << " VM instructions ("
+            << (double) code_size / std::max<size_t>(num_instrs, 1) << " bytes per instruction)" << endl);
+    }
     flush_icache();
     if (debug)
         dump_code();
+    if (uses_cache() && !cached)
+        store_cached_code(key);
+    describe_code(text_mem, jpos.arch);
+    if (tiered)
+        describe_code(ret_pads, ret_pads + prog_size + sizeof(uint64_t), "vm:ret_pads");
 }
 
 
-void JIT::exec_program()
+bool JIT::exec_program()
 {
     DBG("Running program ..." << endl);
 
-    ((void (*)()) text_mem)();
+    if (fuel_counter != nullptr)
+        *fuel_counter = fuel != 0 && fuel < (uint64_t) INT64_MAX ? fuel : INT64_MAX;
+
+    ((void (*)()) (suspended ? resume_stub : text_mem))();
+
+    suspended = fuel_counter != nullptr && *fuel_counter < 0;
+    if (suspended)
+        return false;
 
     if (debug)
         dump_registers();
+    return true;
 }
 
 
@@ -55,26 +138,111 @@ void JIT::fini_execution()
 }
 
 
+void JIT::collect_stats()
+{
+    expand_block_counts(block_counters);
+}
+
+
+bool JIT::owns_fault(const fault_t& fault) const
+{
+    // Data addresses are host addresses, so JIT code may fault on any.
+    bool in_code = fault.host_pc >= (uint64_t) text_mem && fault.host_pc < (uint64_t) text_mem + text_mem_size;
+    return in_code || ExecutionEngine::owns_fault(fault);
+}
+
+
+uint64_t JIT::fault_vm_pc(const fault_t& fault) const
+{
+    if (fault.host_pc < (uint64_t) text_mem || fault.host_pc >= (uint64_t) text_mem + text_mem_size)
+        return UNKNOWN_ADDR;
+
+    // The instruction whose code starts closest at or below the faulting
+    // host PC is the one that faulted. Lazily compiled code is not in VM
+    // address order, so look at all of them.
+    uint64_t vm_pc = UNKNOWN_ADDR, closest = 0;
+    for (uint64_t va = 0; va < va2aa.size(); va++) {
+        if (va2aa[va] == (uint64_t) -1 || va2aa[va] > fault.host_pc)
+            continue;
+        if (va2aa[va] >= closest) {
+            closest = va2aa[va];
+            vm_pc = va;
+        }
+    }
+    return vm_pc;
+}
+
+
+uint64_t JIT::fault_vm_addr(const fault_t& fault) const
+{
+    return fault.host_addr;
+}
+
+
+void JIT::sample(const void* ctx, sample_t& s) const
+{
+    s.pc = context_pc(ctx);
+    bool in_code = s.pc >= (uint64_t) text_mem && s.pc < (uint64_t) text_mem + text_mem_size;
+    // Entering and leaving the code, the VM stack is not in use.
+    const uint64_t* sp = sampled_vm_sp(ctx, in_code);
+    if (sp >= (const uint64_t*) data_mem && sp < (const uint64_t*) stack) {
+        s.sp = sp;
+        s.stack_end = (const uint64_t*) stack;
+    }
+    s.ret_lo = (uint64_t) text_mem;
+    s.ret_hi = (uint64_t) text_mem + text_mem_size;
+}
+
+
+uint64_t JIT::sampled_vm_addr(uint64_t addr)
+{
+    if (tiered && addr >= (uint64_t) ret_pads && addr < (uint64_t) ret_pads + prog_size)
+        return addr - (uint64_t) ret_pads;
+    if (addr < (uint64_t) text_mem || addr >= (uint64_t) jpos.arch)
+        return UNKNOWN_ADDR;
+
+    // The instruction whose code starts closest at or below addr; of those
+    // sharing code, the first, as deleted ones share the next one's.
+    if (sampled_code.empty())
+        sampled_code = code_in(text_mem, jpos.arch);
+    auto c = std::upper_bound(sampled_code.begin(), sampled_code.end(), std::make_pair(addr, UNKNOWN_ADDR));
+    if (c == sampled_code.begin())
+        return UNKNOWN_ADDR;
+    uint64_t aa = (--c)->first;
+    while (c != sampled_code.begin() && (c - 1)->first == aa)
+        --c;
+    return c->second;
+}
+
+
 void JIT::init_memory()
 {
     DBG("Initializing memory ..." << endl);
 
     int prot, flags;
 
+    // Both regions sit between guard pages, so running off the end of the
+    // code or over- or underflowing the stack traps instead of corrupting
+    // whatever happens to be mapped next to them.
     prot = PROT_EXEC | PROT_READ | PROT_WRITE;
     flags = MAP_PRIVATE | MAP_ANONYMOUS;
 #ifdef __APPLE__
     flags |= MAP_JIT;
 #endif
-    text_mem = (uint8_t*) mmap(nullptr, text_mem_size, prot, flags, 0, 0);
-    if (text_mem == MAP_FAILED)
+    text_mem = map_guarded(text_mem_size, prot, flags);
+    if (text_mem == nullptr)
         ABORT("Failed to allocate text VM memory." << endl);
 
     prot = PROT_READ | PROT_WRITE;
-    flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    data_mem = (uint8_t*) mmap(nullptr, data_mem_size, prot, flags, 0, 0);
-    if (text_mem == MAP_FAILED)
+    flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    data_mem = map_guarded(data_mem_size, prot, flags);
+    if (data_mem == nullptr)
         ABORT("Failed to allocate data VM memory." << endl);
+#ifdef MADV_HUGEPAGE
+    if (vm_flags & VM_HUGE_PAGES)
+        if (madvise(data_mem, data_mem_size, MADV_HUGEPAGE) != 0)
+            DBG("\tHuge pages not available" << endl);
+#endif
 
     DBG("\t.text @" << (void*) text_mem << "[" << HEX(0, text_mem_size) << "]" << endl);
     DBG("\t.data @" << (void*) data_mem << "[" << HEX(0, data_mem_size) << "]" << endl);
@@ -83,19 +251,48 @@ void JIT::init_memory()
 
 void JIT::fini_memory()
 {
-    if (munmap(text_mem, text_mem_size) != 0)
-        ABORT("Failed to deallocate text VM memory." << endl);
+    unmap_guarded(text_mem, text_mem_size);
     text_mem = nullptr;
-    if (munmap(data_mem, data_mem_size) != 0)
-        ABORT("Failed to deallocate data VM memory." << endl);
+    unmap_guarded(data_mem, data_mem_size);
     data_mem = nullptr;
 }
 
 
+void JIT::init_layout()
+{
+    stack = data_mem + data_mem_size;
+
+    uint64_t* tail = (uint64_t*) (text_mem + text_mem_size);
+    if (vm_flags & VM_STATS) {
+        tail -= block_addrs.size();
+        block_counters = tail;
+    }
+    if (vm_flags & VM_FUEL) {
+        tail -= 1;
+        fuel_counter = (int64_t*) tail;
+    }
+    if (tiered) {
+        // A spare word, so the jump for the last address still fits.
+        tail -= (prog_size + sizeof(uint64_t) - 1) / sizeof(uint64_t) + 1;
+        ret_pads = (uint8_t*) tail;
+    }
+    text_limit = (uint8_t*) tail;
+}
+
+
 void JIT::init_codegen()
 {
+    va2aa.assign(prog_size, (uint64_t) -1);
+    sampled_code.clear();
+    if (debug)
+        va2idd.resize(prog_size);
+
     jpos.arch = text_mem;
-    stack = data_mem + data_mem_size;
+    jpos.vm = (const uint8_t*) prog;
+    fixups.clear();
+    relocs.clear();
+    span_begin = 0;
+    span_end = prog_size;
 }
 
 
@@ -104,6 +301,23 @@ void JIT::fini_codegen()
 }
 
 
+void JIT::work_for(JIT* engine)
+{
+    owner = engine;
+    text_mem = engine->text_mem;
+    data_mem = engine->data_mem;
+    sys_enter_stub = engine->sys_enter_stub;
+    stack = engine->stack;
+    block_counters = engine->block_counters;
+    fuel_counter = engine->fuel_counter;
+    text_limit = engine->text_limit;
+    yield_stub = engine->yield_stub;
+    resume_stub = engine->resume_stub;
+    tiered = engine->tiered;
+    ret_pads = engine->ret_pads;
+}
+
+
 void JIT::flush_icache()
 {
     /* GCC/clang builtin, cross-platform: __builtin___clear_cache()
@@ -146,8 +360,9 @@ void JIT::dump_code()
 
     {
         std::map<uint64_t, uint64_t> aa2va;
-        for (const auto& e : va2aa)
-            aa2va[e.second] = e.first;
+        for (uint64_t va = 0; va < va2aa.size(); va++)
+            if (va2aa[va] != (uint64_t) -1)
+                aa2va[va2aa[va]] = va;
 
         auto trace = [this, aa2va](std::string& line) {
             static std::regex whitespace_prefix("^\\s+");
@@ -166,7 +381,7 @@ void JIT::dump_code()
             uint64_t va = get_vm_addr(line);
             if (va != (uint64_t) -1 && va != 0) {
                 DBG(endl);
-                trace_instr_decode(prog, va2idd.at(va));
+                trace_instr_decode(prog, va2idd[va]);
                 DBG(endl);
             }
         };
@@ -215,14 +430,1128 @@ void JIT::dump_registers()
 
 void JIT::record_addr_mapping()
 {
-    va2aa[(uint64_t) jpos.vm - (uint64_t) prog] = (uint64_t) jpos.arch;
+    owner->va2aa[(uint64_t) jpos.vm - (uint64_t) prog] = (uint64_t) jpos.arch;
+}
+
+
+void JIT::record_fixup(uint8_t kind, uint64_t vm_target, uint8_t shrink)
+{
+    // Where code out of the span ends up is not known yet; keep it in reach.
+    if (vm_target < span_begin || vm_target >= span_end)
+        shrink = 0;
+    fixups.push_back({ jpos.arch, (uint64_t) (jpos.vm - (const uint8_t*) prog), vm_target, kind, shrink });
+}
+
+
+void JIT::resolve_fixups()
+{
+    for (const auto& fixup : fixups) {
+        uint64_t aa = as_arch_addr(fixup.vm_target);
+        if (aa == (uint64_t) -1)
+            ABORT("Jump to an address which is not an instruction boundary." << endl);
+        patch_fixup(fixup, (const uint8_t*) aa);
+    }
+}
+
+
+bool JIT::relax_branches()
+{
+    /* Fixups are recorded in code order and, being forward, never straddle
+     * another fixup's target. Shortening the fixups between a branch and its
+     * target brings the target closer by the sum of their shrink, so keep
+     * relaxing until no branch changes. Code only gets smaller when JITing
+     * again with the result, so every branch chosen here still reaches.
+     */
+    size_t n = fixups.size();
+    std::vector<const uint8_t*> target(n);
+    for (size_t i = 0; i < n; i++)
+        target[i] = (const uint8_t*) as_arch_addr(fixups[i].vm_target);
+
+    std::vector<bool> relaxed(n, false);
+    std::vector<uint64_t> saved(n + 1, 0);
+    size_t num_relaxed = 0;
+    bool changed;
+    do {
+        changed = false;
+        for (size_t i = 0; i < n; i++)
+            saved[i + 1] = saved[i] + (relaxed[i] ? fixups[i].shrink : 0);
+        for (size_t i = 0; i < n; i++) {
+            if (relaxed[i] || fixups[i].shrink == 0)
+                continue;
+            auto last = std::upper_bound(fixups.begin() + i + 1, fixups.end(), target[i],
+                [](const uint8_t* aa, const fixup_t& f) { return aa < f.arch; });
+            int64_t rel = (target[i] - fixups[i].arch) - (saved[last - fixups.begin()] - saved[i + 1]);
+            if (fits_short_branch(rel)) {
+                relaxed[i] = true;
+                num_relaxed++;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    if (num_relaxed == 0)
+        return false;
+
+    DBG("\tRelaxed " << num_relaxed << " of " << std::count_if(fixups.begin(), fixups.end(),
+        [](const fixup_t& f) { return f.shrink != 0; }) << " forward branches" << endl);
+    short_branches.assign(prog_size, false);
+    for (size_t i = 0; i < n; i++)
+        if (relaxed[i])
+            short_branches[fixups[i].vm] = true;
+    return true;
+}
+
+
+bool JIT::is_short_branch() const
+{
+    uint64_t va = jpos.vm - (const uint8_t*) prog;
+    return va < owner->short_branches.size() && owner->short_branches[va];
 }
 
 
 uint64_t JIT::as_arch_addr(uint64_t vm_addr) const
 {
-    auto m = va2aa.find(vm_addr);
-    return m != va2aa.end() ? m->second : -1;
+    return vm_addr >= span_begin && vm_addr < span_end ? owner->va2aa[vm_addr] : -1;
+}
+
+
+ssize_t JIT::block_index(uint64_t vm_addr) const
+{
+    const std::vector<uint64_t>& addrs = owner->block_addrs;
+    auto b = std::lower_bound(addrs.begin(), addrs.end(), vm_addr);
+    return b != addrs.end() && *b == vm_addr ? b - addrs.begin() : -1;
+}
+
+
+uint64_t* JIT::block_counter(uint64_t vm_addr) const
+{
+    if (block_counters == nullptr)
+        return nullptr;
+    ssize_t b = block_index(vm_addr);
+    return b >= 0 ? block_counters + b : nullptr;
+}
+
+
+bool JIT::needs_fuel_check(uint64_t vm_addr) const
+{
+    return fuel_counter != nullptr && block_index(vm_addr) >= 0;
+}
+
+
+bool JIT::flags_live_at(uint64_t vm_addr) const
+{
+    uint32_t b = ir_block_at(vm_addr);
+    return b == NO_BLOCK || (ir_blocks[b].live_in & (1 << FLAGS)) != 0;
+}
+
+
+void JIT::record_reloc(reloc_kind_t kind, const uint8_t* field, uint64_t addr)
+{
+    relocs.push_back({ (uint64_t) (field - text_mem), (int64_t) (addr - reloc_base(kind)), kind });
+}
+
+
+uint64_t JIT::reloc_base(uint64_t kind) const
+{
+    switch (kind) {
+    case RELOC_TEXT:        return (uint64_t) text_mem;
+    case RELOC_DATA:        return (uint64_t) data_mem;
+    case RELOC_REGS:        return (uint64_t) owner->reg_dump_area.get();
+    case RELOC_ENGINE:      return (uint64_t) owner;
+    case RELOC_HOST_CODE:   return (uint64_t) &sys_enter;
+    default:                return 0;
+    }
+}
+
+
+bool JIT::uses_cache() const
+{
+    // Lazily compiled code is never complete.
+    return !cache_dir.empty() && relocatable && !lazy;
+}
+
+
+uint64_t JIT::cache_key() const
+{
+    // The VM library file stands in for the build the code came from.
+    struct stat lib = {};
+    Dl_info info;
+    if (dladdr((void*) &sys_enter, &info) != 0 && info.dli_fname != nullptr)
+        stat(info.dli_fname, &lib);
+
+    uint64_t cpu[4] = {};
+    get_cpu_features(cpu);
+
+    uint64_t key[] = {
+        CACHE_VERSION,
+        (uint64_t) lib.st_dev, (uint64_t) lib.st_ino, (uint64_t) lib.st_size, (uint64_t) lib.st_mtime,
+        cpu[0], cpu[1], cpu[2], cpu[3],
+        mem_size, prog_size, vm_flags & ~(uint64_t) (VM_HUGE_PAGES | VM_PERF_MAP | VM_JITDUMP), tiered,
+    };
+    uint64_t hash = fnv1a(key, sizeof(key));
+    hash = fnv1a(get_objdump_fmt(), std::strlen(get_objdump_fmt()), hash);
+    return fnv1a(prog, prog_size, hash);
+}
+
+
+std::string JIT::cache_path(uint64_t key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.jit", (unsigned long long) key);
+    return cache_dir + name;
+}
+
+
+bool JIT::load_cached_code(uint64_t key)
+{
+    std::string path = cache_path(key);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* file = fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(cache_header_t)
+        ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (file == MAP_FAILED) {
+        DBG("\tIgnoring unreadable code cache entry " << path << endl);
+        return false;
+    }
+
+    const cache_header_t* header = (const cache_header_t*) file;
+    const uint8_t* pos = (const uint8_t*) (header + 1);
+    const uint8_t* end = (const uint8_t*) file + st.st_size;
+    bool ok = std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+        && header->version == CACHE_VERSION
+        && header->key == key
+        && header->payload_size == (uint64_t) (end - pos)
+        && header->payload_sum == fnv1a(pos, end - pos);
+
+    // Fields are 8-byte aligned; a short read fails the whole entry.
+    auto get = [&](uint64_t size) -> const uint8_t* {
+        uint64_t padded = (size + 7) & ~(uint64_t) 7;
+        if (!ok || padded < size || padded > (uint64_t) (end - pos)) {
+            ok = false;
+            return nullptr;
+        }
+        const uint8_t* data = pos;
+        pos += padded;
+        return data;
+    };
+    auto get64 = [&]() {
+        const uint8_t* data = get(sizeof(uint64_t));
+        return data != nullptr ? *(const uint64_t*) data : 0;
+    };
+
+    // See store_cached_code() for the layout.
+    uint64_t size = get64();
+    const uint8_t* program = get(size);
+    ok = ok && size == prog_size && std::memcmp(program, prog, prog_size) == 0;
+    uint64_t code_size = get64();
+    const uint8_t* code = get(code_size);
+    ok = ok && code_size <= (uint64_t) (text_limit - text_mem);
+    uint64_t tail_size = get64();
+    const uint8_t* tail = get(tail_size);
+    ok = ok && tail_size == (tiered ? (uint64_t) (text_mem + text_mem_size - text_limit) : 0);
+    uint64_t stubs[3];
+    for (uint64_t& stub : stubs) {
+        stub = get64();
+        ok = ok && (stub == (uint64_t) -1 || stub < code_size);
+    }
+    uint64_t num_mappings = get64();
+    ok = ok && num_mappings <= prog_size;
+    const uint64_t* mappings = (const uint64_t*) get(num_mappings * 2 * sizeof(uint64_t));
+    for (uint64_t i = 0; ok && i < num_mappings; i++)
+        ok = mappings[2 * i] < prog_size && mappings[2 * i + 1] < code_size;
+    uint64_t num_relocs = get64();
+    ok = ok && num_relocs <= code_size;
+    const reloc_t* relocations = (const reloc_t*) get(num_relocs * sizeof(reloc_t));
+    for (uint64_t i = 0; ok && i < num_relocs; i++)
+        ok = relocations[i].offset + sizeof(uint64_t) <= code_size && relocations[i].kind <= RELOC_HOST_CODE;
+    uint64_t num_blocks = get64();
+    ok = ok && num_blocks <= prog_size;
+    const uint64_t* blocks = (const uint64_t*) get(num_blocks * 2 * sizeof(uint64_t));
+    ok = ok && pos == end;
+
+    if (ok) {
+        std::memcpy(text_mem, code, code_size);
+        std::memcpy(text_limit, tail, tail_size);
+        jpos.arch = text_mem + code_size;
+        jpos.vm = (const uint8_t*) prog + prog_size;
+        sys_enter_stub  = stubs[0] != (uint64_t) -1 ? text_mem + stubs[0] : nullptr;
+        yield_stub      = stubs[1] != (uint64_t) -1 ? text_mem + stubs[1] : nullptr;
+        resume_stub     = stubs[2] != (uint64_t) -1 ? text_mem + stubs[2] : nullptr;
+        for (uint64_t i = 0; i < num_mappings; i++) {
+            va2aa[mappings[2 * i]] = (uint64_t) text_mem + mappings[2 * i + 1];
+            if (debug)
+                decode_ir_instr(mappings[2 * i]);
+        }
+        for (uint64_t i = 0; i < num_relocs; i++)
+            *(uint64_t*) (text_mem + relocations[i].offset) = reloc_base(relocations[i].kind) + relocations[i].addend;
+        // Only the flags liveness of the IR is needed to run the code.
+        ir_blocks.clear();
+        ir_block_addrs.clear();
+        for (uint64_t i = 0; i < num_blocks; i++) {
+            ir_blocks.push_back({ 0, 0, { NO_BLOCK, NO_BLOCK }, false, false, 0, 0, (reg_mask_t) blocks[2 * i + 1], 0 });
+            ir_block_addrs.push_back(blocks[2 * i]);
+        }
+        DBG("\tLoaded " << code_size << " bytes of code from " << path << endl);
+    } else {
+        DBG("\tIgnoring corrupt code cache entry " << path << endl);
+    }
+    munmap(file, st.st_size);
+    return ok;
+}
+
+
+void JIT::store_cached_code(uint64_t key) const
+{
+    std::vector<uint8_t> payload;
+    auto put = [&payload](const void* data, uint64_t size) {
+        payload.insert(payload.end(), (const uint8_t*) data, (const uint8_t*) data + size);
+        payload.resize((payload.size() + 7) & ~(size_t) 7);
+    };
+    auto put64 = [&put](uint64_t value) {
+        put(&value, sizeof(value));
+    };
+    auto offset = [this](const uint8_t* aa) {
+        return aa != nullptr ? (uint64_t) (aa - text_mem) : (uint64_t) -1;
+    };
+
+    // The program goes along, so that a key collision cannot go unnoticed;
+    // the tail below the counters holds the return pads of tiered code.
+    uint64_t code_size = jpos.arch - text_mem;
+    uint64_t tail_size = tiered ? text_mem + text_mem_size - text_limit : 0;
+    payload.reserve(prog_size + code_size + tail_size + 2 * sizeof(uint64_t) * (va2aa.size() + ir_blocks.size())
+        + relocs.size() * sizeof(reloc_t) + 16 * sizeof(uint64_t));
+    put64(prog_size);
+    put(prog, prog_size);
+    put64(code_size);
+    put(text_mem, code_size);
+    put64(tail_size);
+    put(text_limit, tail_size);
+    put64(offset(sys_enter_stub));
+    put64(offset(yield_stub));
+    put64(offset(resume_stub));
+    put64(std::count_if(va2aa.begin(), va2aa.end(), [](uint64_t aa) { return aa != (uint64_t) -1; }));
+    for (uint64_t va = 0; va < va2aa.size(); va++) {
+        if (va2aa[va] == (uint64_t) -1)
+            continue;
+        put64(va);
+        put64(va2aa[va] - (uint64_t) text_mem);
+    }
+    put64(relocs.size());
+    put(relocs.data(), relocs.size() * sizeof(reloc_t));
+    put64(ir_blocks.size());
+    for (size_t b = 0; b < ir_blocks.size(); b++) {
+        put64(ir_block_addrs[b]);
+        put64(ir_blocks[b].live_in);
+    }
+
+    cache_header_t header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.payload_size = payload.size();
+    header.payload_sum = fnv1a(payload.data(), payload.size());
+
+    // Written aside and renamed into place, so readers only ever see whole
+    // entries, whichever of several concurrent writers comes last.
+    std::string path = cache_path(key);
+    std::string temp = path + ".XXXXXX";
+    mkdir(cache_dir.c_str(), 0777);
+    int fd = mkstemp(&temp[0]);
+    if (fd < 0) {
+        DBG("\tFailed to create code cache entry " << temp << endl);
+        return;
+    }
+    auto write_all = [fd](const void* data, size_t size) {
+        for (const uint8_t* p = (const uint8_t*) data; size > 0; ) {
+            ssize_t n = write(fd, p, size);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    };
+    bool ok = write_all(&header, sizeof(header)) && write_all(payload.data(), payload.size());
+    ok = close(fd) == 0 && ok;
+    if (ok && std::rename(temp.c_str(), path.c_str()) == 0) {
+        DBG("\tStored " << code_size << " bytes of code in " << path << endl);
+    } else {
+        unlink(temp.c_str());
+        DBG("\tFailed to store code in " << path << endl);
+    }
+}
+
+
+void JIT::describe_code(const uint8_t* begin, const uint8_t* end, const char* stub_name)
+{
+    if (!(vm_flags & (VM_PERF_MAP | VM_JITDUMP)) || begin >= end)
+        return;
+
+    // The code of the VM addresses in [begin, end), in host order. Deleted
+    // instructions share the code of the next one, and lazily compiled code
+    // is not in VM address order, so a symbol also starts where it is not.
+    std::vector<std::pair<uint64_t, uint64_t>> code = code_in(begin, end);
+
+    auto starts_symbol = [this](uint64_t va) {
+        return labels.empty()
+            ? std::binary_search(ir_block_addrs.begin(), ir_block_addrs.end(), va)
+            : labels.count(va) != 0;
+    };
+    std::vector<std::pair<uint64_t, uint64_t>> symbols;
+    if (code.empty() || code[0].first > (uint64_t) begin)
+        symbols.push_back({ (uint64_t) begin, UNKNOWN_ADDR });
+    for (size_t i = 0; i < code.size(); i++) {
+        auto [aa, va] = code[i];
+        if (i > 0 && !starts_symbol(va) && va > code[i - 1].second)
+            continue;
+        if (!symbols.empty() && symbols.back().first == aa)
+            symbols.back().second = va;
+        else
+            symbols.push_back({ aa, va });
+    }
+
+    std::lock_guard<std::mutex> lock(perf_lock);
+
+    if ((vm_flags & VM_JITDUMP) && jitdump_pid != getpid()) {
+        // perf inject finds the file by the mapping of its first page.
+        std::string path = "/tmp/jit-" + std::to_string(getpid()) + ".dump";
+        jitdump_file = std::fopen(path.c_str(), "w+");
+        jitdump_pid = getpid();
+        jitdump_index = 0;
+        if (jitdump_file == nullptr ||
+            mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(jitdump_file), 0) == MAP_FAILED) {
+            ERR("Failed to create jitdump file '" << path << "'." << endl);
+        } else {
+#if defined(__x86_64__)
+            uint32_t elf_mach = 62;     // EM_X86_64
+#elif defined(__aarch64__)
+            uint32_t elf_mach = 183;    // EM_AARCH64
+#else
+            uint32_t elf_mach = 0;
+#endif
+            jitdump_header_t header = {
+                JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(jitdump_header_t), elf_mach, 0, (uint32_t) getpid(),
+                perf_timestamp(), 0,
+            };
+            std::fwrite(&header, sizeof(header), 1, jitdump_file);
+        }
+    }
+
+    std::ostringstream map;
+    for (size_t i = 0; i < symbols.size(); i++) {
+        uint64_t aa = symbols[i].first;
+        uint64_t size = (i + 1 < symbols.size() ? symbols[i + 1].first : (uint64_t) end) - aa;
+        std::string name = symbols[i].second == UNKNOWN_ADDR ? stub_name : "vm:" + label_of(symbols[i].second);
+        map << std::hex << aa << " " << size << std::dec << " " << name << "\n";
+        if ((vm_flags & VM_JITDUMP) && jitdump_file != nullptr) {
+            jitdump_code_load_t record = {
+                JIT_CODE_LOAD, (uint32_t) (sizeof(jitdump_code_load_t) + name.size() + 1 + size), perf_timestamp(),
+                (uint32_t) getpid(), (uint32_t) syscall(SYS_gettid), aa, aa, size, jitdump_index++,
+            };
+            std::fwrite(&record, sizeof(record), 1, jitdump_file);
+            std::fwrite(name.c_str(), name.size() + 1, 1, jitdump_file);
+            std::fwrite((const void*) aa, size, 1, jitdump_file);
+        }
+    }
+    if (jitdump_file != nullptr)
+        std::fflush(jitdump_file);
+
+    if (vm_flags & VM_PERF_MAP) {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        FILE* mf = std::fopen(path.c_str(), "a");
+        if (mf == nullptr || std::fputs(map.str().c_str(), mf) < 0)
+            ERR("Failed to write perf map '" << path << "'." << endl);
+        if (mf != nullptr)
+            std::fclose(mf);
+    }
+    DBG("	Described " << symbols.size() << " symbols to perf" << endl);
+}
+
+
+std::vector<std::pair<uint64_t, uint64_t>> JIT::code_in(const uint8_t* begin, const uint8_t* end) const
+{
+    std::vector<std::pair<uint64_t, uint64_t>> code;
+    for (uint64_t va = 0; va < va2aa.size(); va++)
+        if (va2aa[va] >= (uint64_t) begin && va2aa[va] < (uint64_t) end)
+            code.push_back({ va2aa[va], va });
+    std::sort(code.begin(), code.end());
+    return code;
+}
+
+
+void JIT::build_ir()
+{
+    std::vector<bool> leader(prog_size + 1, false);
+    std::vector<bool> target(prog_size + 1, false);
+    std::vector<uint64_t> addrs;
+
+    ir.clear();
+    ir.reserve(prog_size / 4 + 1);
+    addrs.reserve(prog_size / 4 + 1);
+    leader[0] = true;
+    for (uint64_t addr = 0; addr < prog_size; addr += ir.back().len) {
+        ir_instr_t ins = decode_ir_instr(addr);
+        switch (ins.op) {
+        case CALL:
+        case JMP:
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+        case JMPGE:
+        case JMPLE:
+            leader[ins.idd.ivu] = target[ins.idd.ivu] = true;
+            leader[addr + ins.len] = true;
+            break;
+        case RET:
+            leader[addr + ins.len] = true;
+            break;
+        }
+        ir.push_back(ins);
+        addrs.push_back(addr);
+    }
+
+    ir_blocks.clear();
+    ir_block_addrs.clear();
+    for (uint32_t i = 0; i < addrs.size(); i++) {
+        if (leader[addrs[i]]) {
+            if (!ir_blocks.empty())
+                ir_blocks.back().end = i;
+            ir_blocks.push_back({ i, i, { NO_BLOCK, NO_BLOCK }, false, false, 0, 0, 0, 0 });
+            ir_block_addrs.push_back(addrs[i]);
+        }
+    }
+    ir_blocks.back().end = ir.size();
+
+    for (uint32_t b = 0; b < ir_blocks.size(); b++) {
+        ir_block_t& blk = ir_blocks[b];
+        const ir_instr_t& last = ir[blk.end - 1];
+        uint32_t next = b + 1 < ir_blocks.size() ? b + 1 : NO_BLOCK;
+        switch (last.op) {
+        case CALL:
+        case RET:
+            blk.exits = true;
+            break;
+        case JMP:
+            // A jump to SYS_ENTER_ADDR is a system call.
+            if (last.idd.ivu == SYS_ENTER_ADDR)
+                blk.exits = true;
+            else
+                blk.succ[0] = ir_block_at(last.idd.ivu);
+            break;
+        case JMPEQ:
+        case JMPNE:
+        case JMPGT:
+        case JMPLT:
+        case JMPGE:
+        case JMPLE:
+            blk.succ[0] = ir_block_at(last.idd.ivu);
+            blk.succ[1] = next;
+            if (next != NO_BLOCK && !target[ir_block_addrs[next]])
+                ir_blocks[next].extends = true;
+            break;
+        default:
+            blk.succ[0] = next;
+            break;
+        }
+        if (blk.succ[0] == NO_BLOCK && blk.succ[1] == NO_BLOCK)
+            blk.exits = true;
+    }
+}
+
+
+JIT::ir_instr_t JIT::decode_ir_instr(uint64_t addr)
+{
+    const uint8_t* code = (const uint8_t*) prog;
+    ir_instr_t ins = {};
+    ins.op = instr(code[addr]);
+    ins.idd.addr = addr;
+    switch (ins.op) {
+    case LOAD:
+    case STORE:
+        ins.idd.dst = reg_dst(code[addr + 1]);
+        ins.idd.src = reg_src(code[addr + 1]);
+        ins.idd.idx = imm16s(code[addr + 2]);
+        ins.len = 4;
+        break;
+    case MOV:
+    case ADD:
+    case SUB:
+    case AND:
+    case OR:
+    case XOR:
+    case CMP:
+        ins.idd.am = access_mode(code[addr]);
+        ins.idd.dst = reg_dst(code[addr + 1]);
+        if (ins.idd.am == REG) {
+            ins.idd.src = reg_src(code[addr + 1]);
+            ins.len = 2;
+        } else {
+            ins.idd.ivu = imm64u(code[addr + 2]);
+            ins.idd.ivs = imm64s(code[addr + 2]);
+            ins.len = 10;
+        }
+        break;
+    case NOT:
+    case PUSH:
+    case POP:
+        ins.idd.dst = reg_dst(code[addr + 1]);
+        ins.len = 2;
+        break;
+    case CALL:
+    case JMP:
+    case JMPEQ:
+    case JMPNE:
+    case JMPGT:
+    case JMPLT:
+    case JMPGE:
+    case JMPLE:
+        ins.idd.ivu = imm64u(code[addr + 1]);
+        ins.len = 9;
+        break;
+    case RET:
+        ins.len = 1;
+        break;
+    }
+    update_use_def(ins);
+    if (debug)
+        va2idd[addr] = ins.idd;
+    return ins;
+}
+
+
+void JIT::optimize_ir()
+{
+    size_t slots = 0, constants = 0, copies = 0, compares = 0;
+
+    // Run the forward passes back to back on each extended block, while its
+    // instructions are still in cache.
+    ir_values.clear();
+    for (uint8_t r = 0; r < NUM_VALUE_REGS; r++)
+        new_value(r);
+    for (uint32_t first = 0, last; first < ir_blocks.size(); first = last) {
+        for (last = first + 1; last < ir_blocks.size() && ir_blocks[last].extends; last++)
+            ;
+        number_values(first, last);
+        slots += forward_stack_slots(first, last);
+        constants += propagate_constants(first, last);
+        copies += propagate_copies(first, last);
+        compares += eliminate_redundant_compares(first, last);
+        summarize_blocks(first, last);
+    }
+    compute_liveness();
+    // Deleting definitions only shrinks the live sets, so the ones computed
+    // before remain a safe over-approximation.
+    size_t stores = eliminate_dead_stores();
+
+    DBG("\tIR: " << ir.size() << " instructions in " << ir_blocks.size() << " blocks, "
+        << slots << " stack accesses forwarded, " << constants << " constants and " << copies << " copies propagated, "
+        << compares << " compares and " << stores << " dead stores eliminated" << endl);
+}
+
+
+void JIT::number_values(uint32_t first, uint32_t last)
+{
+    uint32_t cur[NUM_VALUE_REGS];
+    uint32_t begin = ir_blocks[first].begin, end = ir_blocks[last - 1].end;
+
+    // Only the values registers hold on entry survive from the last block.
+    ir_values.resize(NUM_VALUE_REGS);
+    for (uint8_t r = 0; r < NUM_VALUE_REGS; r++)
+        cur[r] = r;
+    if (ir_vnums.size() < end - begin)
+        ir_vnums.resize(end - begin);
+    for (uint32_t i = begin; i < end; i++) {
+        const ir_instr_t& ins = ir[i];
+        const instr_decode_data_t& idd = ins.idd;
+        ir_value_nums_t& vn = ir_vnums[i - begin];
+        vn = { NO_VALUE, NO_VALUE, NO_VALUE };
+        switch (ins.op) {
+        case LOAD:
+            vn.src = cur[idd.src];
+            vn.def = cur[idd.dst] = new_value(idd.dst);
+            break;
+        case STORE:
+            vn.dst = cur[idd.dst];
+            vn.src = cur[idd.src];
+            break;
+        case MOV:
+            if (idd.am == IMM) {
+                vn.def = new_value(idd.dst, true, idd.ivu);
+            } else {
+                vn.src = cur[idd.src];
+                // SP changes under push and pop, so it never shares a value.
+                vn.def = idd.dst == SP || idd.src == SP ? new_value(idd.dst) : vn.src;
+            }
+            cur[idd.dst] = vn.def;
+            break;
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+            vn.dst = cur[idd.dst];
+            if (idd.am == REG)
+                vn.src = cur[idd.src];
+            vn.def = cur[idd.dst] = new_value(idd.dst);
+            break;
+        case NOT:
+            vn.dst = cur[idd.dst];
+            vn.def = cur[idd.dst] = new_value(idd.dst);
+            break;
+        case CMP:
+            vn.dst = cur[idd.dst];
+            if (idd.am == REG)
+                vn.src = cur[idd.src];
+            break;
+        case PUSH:
+            vn.dst = cur[idd.dst];
+            cur[SP] = new_value(SP);
+            break;
+        case POP:
+            cur[SP] = new_value(SP);
+            vn.def = cur[idd.dst] = new_value(idd.dst);
+            break;
+        }
+    }
+}
+
+
+size_t JIT::forward_stack_slots(uint32_t first, uint32_t last)
+{
+    uint32_t cur[NUM_VALUE_REGS];
+    uint32_t begin = ir_blocks[first].begin, end = ir_blocks[last - 1].end;
+    int64_t sp = 0;         // offset from SP on entry
+    bool sp_known = true;
+    size_t count = 0;
+
+    // Slots are keyed by their offset from SP on entry and hold the value
+    // last written to or read from them.
+    auto slot = [this](int64_t addr) {
+        auto s = std::find_if(ir_slots.begin(), ir_slots.end(), [addr](const stack_slot_t& s) { return s.addr == addr; });
+        return s != ir_slots.end() ? s->value : NO_VALUE;
+    };
+    auto set_slot = [this](int64_t addr, uint32_t v) {
+        ir_slots.erase(std::remove_if(ir_slots.begin(), ir_slots.end(),
+            [addr](const stack_slot_t& s) { return s.addr > addr - 8 && s.addr < addr + 8; }), ir_slots.end());
+        ir_slots.push_back({ addr, v });
+    };
+    auto lose_sp = [&]() {
+        sp_known = false;
+        ir_slots.clear();
+    };
+
+    for (uint8_t r = 0; r < NUM_VALUE_REGS; r++)
+        cur[r] = r;
+    ir_slots.clear();
+    ir_value_repl.resize(ir_values.size());
+    std::iota(ir_value_repl.begin(), ir_value_repl.end(), 0);
+    for (uint32_t i = begin; i < end; i++) {
+        ir_instr_t& ins = ir[i];
+        instr_decode_data_t& idd = ins.idd;
+        ir_value_nums_t& vn = ir_vnums[i - begin];
+        for (uint32_t* v : { &vn.dst, &vn.src, &vn.def })
+            if (*v != NO_VALUE)
+                *v = ir_value_repl[*v];
+
+        switch (ins.op) {
+        case LOAD: {
+            uint32_t v = idd.src == SP && sp_known ? slot(sp + idd.idx) : NO_VALUE;
+            if (idd.dst == SP) {
+                lose_sp();
+                break;
+            }
+            if (v == NO_VALUE) {
+                if (idd.src == SP && sp_known)
+                    set_slot(sp + idd.idx, vn.def);
+                break;
+            }
+            // The slot holds a known value: reuse whichever register still
+            // has it instead of going through memory.
+            ir_value_repl[vn.def] = v;
+            vn.def = v;
+            uint8_t h = cur[idd.dst] == v ? idd.dst : NUM_VALUE_REGS;
+            for (uint8_t r = 0; h == NUM_VALUE_REGS && r < FLAGS; r++)
+                if (cur[r] == v)
+                    h = r;
+            if (h == idd.dst) {
+                ins.op = IR_NOP;
+            } else if (h != NUM_VALUE_REGS) {
+                ins.op = MOV;
+                idd.am = REG;
+                idd.src = h;
+                vn.src = v;
+            } else if (ir_values[v].is_const) {
+                ins.op = MOV;
+                idd.am = IMM;
+                idd.ivu = ir_values[v].k;
+                idd.ivs = (int64_t) idd.ivu;
+                vn.src = NO_VALUE;
+            } else {
+                break;
+            }
+            update_use_def(ins);
+            count++;
+            break;
+        }
+        case STORE:
+            if (idd.dst != SP || !sp_known) {
+                // Could write anywhere, the stack included.
+                ir_slots.clear();
+            } else if (slot(sp + idd.idx) == vn.src) {
+                // Memory already holds the value.
+                ins.op = IR_NOP;
+                update_use_def(ins);
+                count++;
+            } else {
+                set_slot(sp + idd.idx, vn.src);
+            }
+            break;
+        case PUSH:
+            sp -= 8;
+            if (sp_known)
+                set_slot(sp, vn.dst);
+            break;
+        case POP:
+            if (sp_known && slot(sp) != NO_VALUE) {
+                ir_value_repl[vn.def] = slot(sp);
+                vn.def = slot(sp);
+            }
+            sp += 8;
+            if (idd.dst == SP)
+                lose_sp();
+            break;
+        case ADD:
+        case SUB:
+            if (idd.dst == SP) {
+                if (idd.am == IMM)
+                    sp += ins.op == ADD ? idd.ivs : -idd.ivs;
+                else
+                    lose_sp();
+            }
+            break;
+        case MOV:
+        case AND:
+        case OR:
+        case XOR:
+        case NOT:
+            if (idd.dst == SP)
+                lose_sp();
+            break;
+        case CALL:
+            ir_slots.clear();
+            break;
+        }
+
+        switch (ins.op) {
+        case LOAD:
+        case MOV:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+        case NOT:
+        case POP:
+            cur[idd.dst] = vn.def;
+            break;
+        }
+        if (ins.op == PUSH || ins.op == POP)
+            cur[SP] = NO_VALUE;
+    }
+    return count;
+}
+
+
+size_t JIT::propagate_constants(uint32_t first, uint32_t last)
+{
+    uint32_t begin = ir_blocks[first].begin, end = ir_blocks[last - 1].end;
+    size_t count = 0;
+
+    for (uint32_t i = begin; i < end; i++) {
+        ir_instr_t& ins = ir[i];
+        ir_value_nums_t& vn = ir_vnums[i - begin];
+        instr_decode_data_t& idd = ins.idd;
+        switch (ins.op) {
+        case MOV:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+        case CMP:
+            if (idd.am == REG && value_is_const(vn.src)) {
+                idd.am = IMM;
+                idd.ivu = ir_values[vn.src].k;
+                idd.ivs = (int64_t) idd.ivu;
+                vn.src = NO_VALUE;
+                update_use_def(ins);
+                count++;
+            }
+            break;
+        }
+
+        uint64_t k;
+        switch (ins.op) {
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+            if (idd.am == REG || !value_is_const(vn.dst))
+                continue;
+            k = ir_values[vn.dst].k;
+            switch (ins.op) {
+            case ADD:   k += idd.ivu;   break;
+            case SUB:   k -= idd.ivu;   break;
+            case AND:   k &= idd.ivu;   break;
+            case OR:    k |= idd.ivu;   break;
+            case XOR:   k ^= idd.ivu;   break;
+            }
+            break;
+        case NOT:
+            if (!value_is_const(vn.dst))
+                continue;
+            k = ~ir_values[vn.dst].k;
+            break;
+        default:
+            continue;
+        }
+
+        ins.op = MOV;
+        idd.am = IMM;
+        idd.ivu = k;
+        idd.ivs = (int64_t) k;
+        vn.dst = NO_VALUE;
+        ir_values[vn.def].is_const = true;
+        ir_values[vn.def].k = k;
+        update_use_def(ins);
+        count++;
+    }
+    return count;
+}
+
+
+size_t JIT::propagate_copies(uint32_t first, uint32_t last)
+{
+    uint32_t cur[NUM_VALUE_REGS];
+    uint32_t begin = ir_blocks[first].begin, end = ir_blocks[last - 1].end;
+    size_t count = 0;
+
+    // A register read for value v can read the register that defined v
+    // instead, as long as that one still holds it.
+    auto forward = [&](uint8_t& reg, uint32_t v) {
+        uint8_t h = ir_values[v].holder;
+        if (h != reg && h != SP && reg != SP && cur[h] == v) {
+            reg = h;
+            count++;
+        }
+    };
+
+    for (uint8_t r = 0; r < NUM_VALUE_REGS; r++)
+        cur[r] = r;
+    for (uint32_t i = begin; i < end; i++) {
+        ir_instr_t& ins = ir[i];
+        ir_value_nums_t& vn = ir_vnums[i - begin];
+        instr_decode_data_t& idd = ins.idd;
+        switch (ins.op) {
+        case STORE:
+            forward(idd.dst, vn.dst);
+            forward(idd.src, vn.src);
+            break;
+        case LOAD:
+            forward(idd.src, vn.src);
+            break;
+        case CMP:
+            forward(idd.dst, vn.dst);
+            if (idd.am == REG)
+                forward(idd.src, vn.src);
+            break;
+        case PUSH:
+            forward(idd.dst, vn.dst);
+            break;
+        case MOV:
+            if (idd.am == REG && cur[idd.dst] == vn.def) {
+                // Already holds the value it would be given.
+                ins.op = IR_NOP;
+                count++;
+                break;
+            }
+            if (idd.am == REG)
+                forward(idd.src, vn.src);
+            break;
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+            if (idd.am == REG)
+                forward(idd.src, vn.src);
+            break;
+        }
+        update_use_def(ins);
+
+        switch (ins.op) {
+        case LOAD:
+        case MOV:
+        case ADD:
+        case SUB:
+        case AND:
+        case OR:
+        case XOR:
+        case NOT:
+        case POP:
+            cur[idd.dst] = vn.def;
+            break;
+        }
+        if (ins.op == PUSH || ins.op == POP)
+            cur[SP] = NO_VALUE;
+    }
+    return count;
+}
+
+
+size_t JIT::eliminate_redundant_compares(uint32_t first, uint32_t last)
+{
+    struct {
+        uint32_t lhs, rhs;
+        uint8_t am;
+        uint64_t imm;
+    } prev = {};
+    bool valid = false;
+    uint32_t begin = ir_blocks[first].begin, end = ir_blocks[last - 1].end;
+    size_t count = 0;
+
+    for (uint32_t i = begin; i < end; i++) {
+        ir_instr_t& ins = ir[i];
+        ir_value_nums_t& vn = ir_vnums[i - begin];
+        if (ins.op != CMP) {
+            if (clobbers_flags(ins))
+                valid = false;
+            continue;
+        }
+        const instr_decode_data_t& idd = ins.idd;
+        if (valid && prev.lhs == vn.dst && prev.am == idd.am
+            && (idd.am == REG ? prev.rhs == vn.src : prev.imm == idd.ivu)) {
+            ins.op = IR_NOP;
+            update_use_def(ins);
+            count++;
+            continue;
+        }
+        prev = { vn.dst, vn.src, idd.am, idd.ivu };
+        valid = true;
+    }
+    return count;
+}
+
+
+size_t JIT::eliminate_dead_stores()
+{
+    size_t count = 0;
+
+    for (const ir_block_t& blk : ir_blocks) {
+        reg_mask_t live = blk.live_out;
+        for (uint32_t i = blk.end; i-- > blk.begin; ) {
+            ir_instr_t& ins = ir[i];
+            bool pure = ins.op == MOV || (ins.op >= ADD && ins.op <= CMP);
+            if (pure && ins.idd.dst != SP && (ins.def & live) == 0) {
+                ins.op = IR_NOP;
+                update_use_def(ins);
+                count++;
+                continue;
+            }
+            live = (live & ~ins.def) | ins.use;
+        }
+    }
+    return count;
+}
+
+
+void JIT::summarize_blocks(uint32_t first, uint32_t last)
+{
+    for (uint32_t b = first; b < last; b++) {
+        ir_block_t& blk = ir_blocks[b];
+        blk.use = blk.def = 0;
+        for (uint32_t i = blk.begin; i < blk.end; i++) {
+            blk.use |= ir[i].use & ~blk.def;
+            blk.def |= ir[i].def;
+        }
+    }
+}
+
+
+void JIT::compute_liveness()
+{
+    for (ir_block_t& blk : ir_blocks)
+        blk.live_in = blk.live_out = 0;
+
+    bool changed;
+    do {
+        changed = false;
+        for (size_t b = ir_blocks.size(); b-- > 0; ) {
+            ir_block_t& blk = ir_blocks[b];
+            reg_mask_t out = blk.exits ? ALL_REGS : 0;
+            for (uint32_t s : blk.succ)
+                if (s != NO_BLOCK)
+                    out |= ir_blocks[s].live_in;
+            reg_mask_t in = blk.use | (out & ~blk.def);
+            if (in != blk.live_in || out != blk.live_out) {
+                blk.live_in = in;
+                blk.live_out = out;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+
+uint32_t JIT::ir_block_at(uint64_t vm_addr) const
+{
+    auto b = std::upper_bound(ir_block_addrs.begin(), ir_block_addrs.end(), vm_addr);
+    return b != ir_block_addrs.begin() ? (b - 1) - ir_block_addrs.begin() : NO_BLOCK;
+}
+
+
+uint32_t JIT::new_value(uint8_t holder, bool is_const, uint64_t k)
+{
+    ir_values.push_back({ holder, is_const, k });
+    return ir_values.size() - 1;
+}
+
+
+void JIT::update_use_def(ir_instr_t& ins)
+{
+    const instr_decode_data_t& idd = ins.idd;
+    reg_mask_t dst = 1 << idd.dst, src = 1 << idd.src;
+
+    switch (ins.op) {
+    case LOAD:      ins.use = src;                                  ins.def = dst;                  break;
+    case STORE:     ins.use = dst | src;                            ins.def = 0;                    break;
+    case MOV:       ins.use = idd.am == REG ? src : 0;              ins.def = dst;                  break;
+    case ADD:
+    case SUB:
+    case AND:
+    case OR:
+    case XOR:       ins.use = dst | (idd.am == REG ? src : 0);      ins.def = dst;                  break;
+    case NOT:       ins.use = dst;                                  ins.def = dst;                  break;
+    case CMP:       ins.use = dst | (idd.am == REG ? src : 0);      ins.def = 1 << FLAGS;           break;
+    case PUSH:      ins.use = dst | (1 << SP);                      ins.def = 1 << SP;              break;
+    case POP:       ins.use = 1 << SP;                              ins.def = dst | (1 << SP);      break;
+    case CALL:
+    case RET:       ins.use = ALL_REGS;                             ins.def = 0;                    break;
+    case JMP:       ins.use = 0;                                    ins.def = 0;                    break;
+    case JMPEQ:
+    case JMPNE:
+    case JMPGT:
+    case JMPLT:
+    case JMPGE:
+    case JMPLE:     ins.use = 1 << FLAGS;                           ins.def = 0;                    break;
+    default:        ins.use = 0;                                    ins.def = 0;                    break;
+    }
 }
 
 
@@ -253,3 +1582,40 @@ uint64_t* JIT::sys_enter(uint64_t* sp)
 
     return sp;
 }
+
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+{
+    for (const uint8_t* p = (const uint8_t*) data; size > 0; p++, size--) {
+        hash ^= *p;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+
+static void get_cpu_features(uint64_t features[4])
+{
+#if defined(__x86_64__)
+    unsigned int a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        features[0] = a;
+        features[1] = ((uint64_t) c << 32) | d;
+    }
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        features[2] = b;
+        features[3] = ((uint64_t) c << 32) | d;
+    }
+#else
+    (void) features;
+#endif
+}
+
+
+static uint64_t perf_timestamp()
+{
+    // The clock 'perf record -k mono' stamps samples with.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
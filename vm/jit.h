@@ -1,17 +1,25 @@
 #pragma once
 
 
-#include <map>
+#include <string>
 #include <vector>
+#include <sys/types.h>
 
 #include "exe.h"
 
 
 class JIT : public ExecutionEngine {
 public:
-    JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug);
+    JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
+
+    // Where load_program() keeps code across processes; empty for nowhere.
+    static void set_cache_dir(const char* dir)      { cache_dir = dir != nullptr ? dir : ""; }
+    // How many threads jit() may use, 0 for as many as pay off.
+    static void set_threads(size_t n)               { num_threads = n; }
 
 protected:
+    friend class TieredEngine;
+
     static constexpr const char* BIN_DUMP_FILE      = "jit.bin";
     static constexpr const char* ASM_DUMP_FILE      = "jit.s";
 
@@ -25,24 +33,252 @@ protected:
     } jit_pos_t;
 
     jit_pos_t                                       jpos;
-    std::vector<jit_pos_t>                          deferred_jpos;
+
+    /* A branch emitted before its target was JITed. It is recorded right
+     * after the instruction whose trailing target field needs patching; the
+     * kind tells the backend how to patch it. shrink is how many bytes a
+     * short encoding of the same branch would save, if there is one.
+     */
+    typedef struct {
+        uint8_t                                     *arch;
+        uint64_t                                    vm;
+        uint64_t                                    vm_target;
+        uint8_t                                     kind;
+        uint8_t                                     shrink;
+    } fixup_t;
+
+    std::vector<fixup_t>                            fixups;
+
+    /* Forward branches that reach their target with a short encoding,
+     * indexed by VM address. Filled by relax_branches() from the layout of
+     * a first jit() pass and used by the second one.
+     */
+    std::vector<bool>                               short_branches;
+
+    /* JIT intermediate representation. build_ir() decodes the program into
+     * one ir_instr_t per VM instruction, in program order, and splits it into
+     * basic blocks; the passes in optimize_ir() rewrite it in place and the
+     * backends lower what is left. Instructions the passes delete become
+     * IR_NOP and lower to nothing, so their address maps to the code of the
+     * next one.
+     *
+     * A block reached only by falling through a conditional jump extends
+     * the previous one. The forward passes work on one such extended block
+     * at a time: every register definition in it gets a value number, the
+     * first NUM_VALUE_REGS being what the registers hold on entry, and copies
+     * share the value of their source, so operands holding the same value are
+     * recognizable across its instructions. use/def masks have one bit per
+     * vm_reg_t, FLAGS included.
+     */
+    typedef uint16_t reg_mask_t;
+
+    static constexpr uint8_t IR_NOP                 = 0;
+    static constexpr uint32_t NO_VALUE              = (uint32_t) -1;
+    static constexpr uint32_t NO_BLOCK              = (uint32_t) -1;
+    static constexpr size_t NUM_VALUE_REGS          = SP + 1;
+    static constexpr reg_mask_t ALL_REGS            = (1 << NUM_VALUE_REGS) - 1;
+
+    typedef struct {
+        instr_decode_data_t                         idd;
+        uint8_t                                     op;
+        uint8_t                                     len;
+        reg_mask_t                                  use;
+        reg_mask_t                                  def;
+    } ir_instr_t;
+
+    typedef struct {
+        uint32_t                                    dst;        // value read through dst
+        uint32_t                                    src;        // value read through src
+        uint32_t                                    def;        // value written to dst
+    } ir_value_nums_t;
+
+    typedef struct {
+        int64_t                                     addr;
+        uint32_t                                    value;
+    } stack_slot_t;
+
+    typedef struct {
+        uint32_t                                    begin, end;
+        uint32_t                                    succ[2];
+        bool                                        exits;      // leaves for code that may read any register
+        bool                                        extends;
+        reg_mask_t                                  use, def;
+        reg_mask_t                                  live_in, live_out;
+    } ir_block_t;
+
+    typedef struct {
+        uint8_t                                     holder;     // register defining it
+        bool                                        is_const;
+        uint64_t                                    k;
+    } ir_value_t;
+
+    std::vector<ir_instr_t>                         ir;
+    std::vector<ir_block_t>                         ir_blocks;
+    std::vector<uint64_t>                           ir_block_addrs;
+    // Scratch of the forward passes, for the extended block at hand.
+    std::vector<ir_value_t>                         ir_values;
+    std::vector<ir_value_nums_t>                    ir_vnums;
+    std::vector<uint32_t>                           ir_value_repl;
+    std::vector<stack_slot_t>                       ir_slots;
 
     uint8_t                                         *sys_enter_stub;
     uint8_t                                         *stack;
-    std::map<uint64_t, uint64_t>                    va2aa;
-    std::map<uint64_t, instr_decode_data_t>         va2idd;
+    // Both indexed by VM address; va2idd is only filled in debug mode.
+    std::vector<uint64_t>                           va2aa;
+    std::vector<instr_decode_data_t>                va2idd;
 
     std::unique_ptr<uint64_t[]>                     reg_dump_area;
 
+    /* The tail of text_mem holds the fuel counter (with VM_FUEL) and one
+     * execution counter per block (with VM_STATS), so emitted code can reach
+     * them PC-relative. Code must stay below text_limit.
+     */
+    uint64_t                                        *block_counters;
+    int64_t                                         *fuel_counter;
+    uint8_t                                         *text_limit;
+
+    // With VM_FUEL, code that runs out of fuel calls yield_stub, which
+    // returns to the host; resume_stub picks up where it left off.
+    uint8_t                                         *yield_stub;
+    uint8_t                                         *resume_stub;
+    bool                                            suspended;
+
+    /* Set by TieredEngine, which enters the code through resume_stub at
+     * whatever block the interpreter has reached. Calls the interpreter
+     * made return to ret_pads plus the VM return address, where a jump on to
+     * the code for that address is placed; ret_pads sits below the counters.
+     */
+    bool                                            tiered;
+    uint8_t                                         *ret_pads;
+
+    /* With VM_LAZY_JIT, jit() only emits the stubs and the code reached
+     * from the entry point; the rest is compiled on first entry, without
+     * the IR passes, by backends that support it.
+     */
+    bool                                            lazy;
+
+    /* The code cache. Backends that can be relocated record each host
+     * address the code holds as a 64-bit immediate, as an offset from one of
+     * a few bases that differ from run to run. Code loaded from the cache is
+     * patched by adding the new bases; everything else in it is relative to
+     * text_mem already. Entries are keyed by everything the code depends on,
+     * the VM library build included, and checksummed.
+     */
+    typedef enum : uint8_t {
+        RELOC_TEXT                                  = 0,    // text_mem
+        RELOC_DATA                                  = 1,    // data_mem
+        RELOC_REGS                                  = 2,    // reg_dump_area
+        RELOC_ENGINE                                = 3,    // the engine itself
+        RELOC_HOST_CODE                             = 4,    // the VM library code, taking sys_enter as its base
+    } reloc_kind_t;
+
+    typedef struct {
+        uint64_t                                    offset;     // of the immediate, from text_mem
+        int64_t                                     addend;
+        uint64_t                                    kind;
+    } reloc_t;
+
+    static constexpr char CACHE_MAGIC[8]            = { 'P', 'C', 'O', 'M', 'P', 'J', 'I', 'T' };
+    static constexpr uint64_t CACHE_VERSION         = 1;
+
+    typedef struct {
+        char                                        magic[8];
+        uint64_t                                    version;
+        uint64_t                                    key;
+        uint64_t                                    payload_size;
+        uint64_t                                    payload_sum;
+    } cache_header_t;
+
+    static std::string                              cache_dir;
+    bool                                            relocatable;
+    std::vector<reloc_t>                            relocs;
+
+    /* Describing the code to Linux perf, with VM_PERF_MAP or VM_JITDUMP. A
+     * symbol starts at the code of each label, or of each basic block without
+     * labels, and runs up to the next one in host order. The perf map takes
+     * a line per symbol; the jitdump, a code load record with a copy of the
+     * code, for perf inject to merge into a 'perf record -k mono' profile.
+     */
+    static constexpr uint32_t JITDUMP_MAGIC         = 0x4a695444;
+    static constexpr uint32_t JITDUMP_VERSION       = 1;
+    static constexpr uint32_t JIT_CODE_LOAD         = 0;
+
+    typedef struct {
+        uint32_t                                    magic;
+        uint32_t                                    version;
+        uint32_t                                    total_size;
+        uint32_t                                    elf_mach;
+        uint32_t                                    pad1;
+        uint32_t                                    pid;
+        uint64_t                                    timestamp;
+        uint64_t                                    flags;
+    } jitdump_header_t;
+
+    typedef struct {
+        uint32_t                                    id;
+        uint32_t                                    total_size;
+        uint64_t                                    timestamp;
+        uint32_t                                    pid;
+        uint32_t                                    tid;
+        uint64_t                                    vma;
+        uint64_t                                    code_addr;
+        uint64_t                                    code_size;
+        uint64_t                                    code_index;
+    } jitdump_code_load_t;
+
+    /* Backends that compile in parallel hand parts of the program to
+     * workers, engines of their own that emit into the text memory of the
+     * engine they work for, their owner; any other engine owns itself. A
+     * worker only sees the code it compiled itself, for the VM addresses in
+     * its span; branches out of it are left for the owner to link.
+     */
+    static size_t                                   num_threads;
+    JIT                                             *owner;
+    uint64_t                                        span_begin, span_end;
+
     void init_execution() override;
     void load_program() override;
-    void exec_program() override;
+    bool exec_program() override;
     void fini_execution() override;
 
+    bool owns_fault(const fault_t& fault) const override;
+    uint64_t fault_vm_pc(const fault_t& fault) const override;
+    uint64_t fault_vm_addr(const fault_t& fault) const override;
+
+    void collect_stats() override;
+    size_t code_size() const override               { return jpos.arch != nullptr ? jpos.arch - text_mem : 0; }
+
+    void sample(const void* ctx, sample_t& s) const override;
+    uint64_t sampled_vm_addr(uint64_t addr) override;
+    // Where the VM stack pointer is at a sample, in the code or out of it.
+    virtual const uint64_t* sampled_vm_sp(const void* ctx, bool in_code) const = 0;
+
     virtual void jit() = 0;
 
+    void build_ir();
+    ir_instr_t decode_ir_instr(uint64_t addr);
+    void optimize_ir();
+    // The forward passes see one extended block, ir_blocks[first, last).
+    void number_values(uint32_t first, uint32_t last);
+    size_t forward_stack_slots(uint32_t first, uint32_t last);
+    size_t propagate_constants(uint32_t first, uint32_t last);
+    size_t propagate_copies(uint32_t first, uint32_t last);
+    size_t eliminate_redundant_compares(uint32_t first, uint32_t last);
+    void summarize_blocks(uint32_t first, uint32_t last);
+    size_t eliminate_dead_stores();
+    void compute_liveness();
+    uint32_t ir_block_at(uint64_t vm_addr) const;
+    uint32_t new_value(uint8_t holder, bool is_const = false, uint64_t k = 0);
+    bool value_is_const(uint32_t v) const           { return v != NO_VALUE && ir_values[v].is_const; }
+    static void update_use_def(ir_instr_t& ins);
+    // Whether lowering ins changes the host flags a cmp left behind.
+    virtual bool clobbers_flags(const ir_instr_t& ins) const = 0;
+
+    void work_for(JIT* engine);
+
     void init_memory();
     void fini_memory();
+    void init_layout();
     void init_codegen();
     void fini_codegen();
     void flush_icache();
@@ -52,7 +288,32 @@ protected:
     void dump_registers();
 
     void record_addr_mapping();
+    void record_fixup(uint8_t kind, uint64_t vm_target, uint8_t shrink = 0);
+    void resolve_fixups();
+    virtual void patch_fixup(const fixup_t& fixup, const uint8_t* target) = 0;
+    bool relax_branches();
+    bool is_short_branch() const;
+    virtual bool fits_short_branch(int64_t rel) const = 0;
     uint64_t as_arch_addr(uint64_t vm_addr) const;
+    ssize_t block_index(uint64_t vm_addr) const;
+    uint64_t* block_counter(uint64_t vm_addr) const;
+    bool needs_fuel_check(uint64_t vm_addr) const;
+    bool flags_live_at(uint64_t vm_addr) const;
+
+    void record_reloc(reloc_kind_t kind, const uint8_t* field, uint64_t addr);
+    uint64_t reloc_base(uint64_t kind) const;
+    bool uses_cache() const;
+    uint64_t cache_key() const;
+    static std::string cache_path(uint64_t key);
+    bool load_cached_code(uint64_t key);
+    void store_cached_code(uint64_t key) const;
+
+    // Code in [begin, end) for no VM address is named stub_name.
+    void describe_code(const uint8_t* begin, const uint8_t* end, const char* stub_name = "vm:stubs");
+    // The VM addresses with code in [begin, end), as (host, VM) address pairs, in order.
+    std::vector<std::pair<uint64_t, uint64_t>> code_in(const uint8_t* begin, const uint8_t* end) const;
+    // All of it, for mapping samples back; filled on first use.
+    std::vector<std::pair<uint64_t, uint64_t>>      sampled_code;
  
     static uint64_t* sys_enter(uint64_t* sp);
 };
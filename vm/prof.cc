@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "prof.h"
+
+
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+std::string Profiler::output;
+
+
+static thread_local Profiler* sampling_profiler = nullptr;
+static struct sigaction prev_sigprof_action;
+
+
+Profiler::Profiler(ExecutionEngine* engine)
+: engine(engine)
+, samples(new uint64_t[MAX_SAMPLE_WORDS]), used(0), taken(0), dropped(0)
+, running(false), next_sample_ns(SAMPLE_PERIOD_NS)
+{
+}
+
+
+Profiler::~Profiler()
+{
+    stop();
+}
+
+
+void Profiler::start()
+{
+    install_sample_handler();
+    sampling_profiler = this;
+
+#ifdef __linux__
+    // Only the thread running the program is sampled, on its own CPU time.
+    struct sigevent sev = {};
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    struct itimerspec its = {};
+    its.it_interval.tv_nsec = SAMPLE_PERIOD_NS;
+    its.it_value.tv_nsec = next_sample_ns;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) {
+        ERR("Failed to create the profiling timer." << endl);
+        return;
+    }
+    if (timer_settime(timer, 0, &its, nullptr) != 0) {
+        timer_delete(timer);
+        ERR("Failed to start the profiling timer." << endl);
+        return;
+    }
+#else
+    struct itimerval itv = {};
+    itv.it_interval.tv_usec = SAMPLE_PERIOD_NS / 1000;
+    itv.it_value.tv_usec = next_sample_ns / 1000;
+    if (setitimer(ITIMER_PROF, &itv, nullptr) != 0) {
+        ERR("Failed to start the profiling timer." << endl);
+        return;
+    }
+#endif
+    running = true;
+}
+
+
+void Profiler::stop()
+{
+    if (!running)
+        return;
+
+    // Slices of a run pick up where the timer left off, so that even
+    // slices shorter than the period are sampled.
+#ifdef __linux__
+    struct itimerspec its = {};
+    timer_gettime(timer, &its);
+    timer_delete(timer);
+    next_sample_ns = its.it_value.tv_nsec;
+#else
+    struct itimerval itv = {};
+    setitimer(ITIMER_PROF, &itv, &itv);
+    next_sample_ns = itv.it_value.tv_usec * 1000;
+#endif
+    if (next_sample_ns <= 0 || next_sample_ns > SAMPLE_PERIOD_NS)
+        next_sample_ns = SAMPLE_PERIOD_NS;
+    // A signal still pending finds no profiler and is dropped.
+    sampling_profiler = nullptr;
+    running = false;
+}
+
+
+void Profiler::report()
+{
+    stop();
+
+    const bool debug = engine->debug;
+    engine->load_labels();
+
+    std::map<uint64_t, uint64_t> flat;
+    std::map<std::string, uint64_t> folded;
+    const std::vector<uint64_t>& returns = engine->return_sites;
+    for (size_t i = 0; i < used; i += 2 + samples[i + 1]) {
+        uint64_t pc = engine->sampled_vm_addr(samples[i]);
+        flat[pc]++;
+
+        std::string stack;
+        for (size_t f = samples[i + 1]; f-- > 0; ) {
+            uint64_t ret = engine->sampled_vm_addr(samples[i + 2 + f]);
+            if (!std::binary_search(returns.begin(), returns.end(), ret))
+                continue;
+            // The call is in the function returned to, which it may end.
+            stack += function_of(ret - 1) + ";";
+        }
+        folded[stack + function_of(pc)]++;
+    }
+
+    std::string prefix = !output.empty() ? output : "/tmp/vm-" + std::to_string(getpid());
+
+    std::vector<std::pair<uint64_t, uint64_t>> by_count(flat.begin(), flat.end());
+    std::stable_sort(by_count.begin(), by_count.end(),
+        [](const auto& a, const auto& b) { return a.second > b.second; });
+    uint64_t recorded = taken - dropped;
+    std::ofstream ff(prefix + ".flat", std::ios::trunc);
+    ff << "# " << taken << " samples, " << SAMPLE_PERIOD_NS / 1000 << " us of CPU time apart, "
+       << dropped << " dropped" << endl;
+    ff << "# samples      %  address  label" << endl;
+    for (const auto& [addr, count] : by_count) {
+        ff << std::setw(9) << std::setfill(' ') << count << " "
+           << std::setw(6) << std::fixed << std::setprecision(2) << 100.0 * count / recorded << "  ";
+        if (addr == ExecutionEngine::UNKNOWN_ADDR)
+            ff << std::setw(8) << "-" << "  [host]" << endl;
+        else
+            ff << HEX_(8, addr) << "  " << engine->label_of(addr) << endl;
+    }
+    if (!ff)
+        ERR("Failed to write profile '" << prefix << ".flat'." << endl);
+
+    std::ofstream sf(prefix + ".folded", std::ios::trunc);
+    for (const auto& [stack, count] : folded)
+        sf << stack << " " << count << endl;
+    if (!sf)
+        ERR("Failed to write profile '" << prefix << ".folded'." << endl);
+
+    DBG("Profile of " << taken << " samples in " << prefix << ".{flat,folded}" << endl);
+}
+
+
+void Profiler::take_sample(const void* ctx)
+{
+    ExecutionEngine::sample_t s = { ExecutionEngine::UNKNOWN_ADDR, nullptr, nullptr, 0, 0 };
+    engine->sample(ctx, s);
+
+    taken++;
+    if (used + 2 + MAX_FRAMES > MAX_SAMPLE_WORDS) {
+        dropped++;
+        return;
+    }
+
+    uint64_t* frames = &samples[used + 2];
+    size_t n = 0;
+    if (s.sp != nullptr && s.sp < s.stack_end) {
+        const uint64_t* end = std::min(s.stack_end, s.sp + MAX_SCAN_WORDS);
+        for (const uint64_t* w = s.sp; w < end && n < MAX_FRAMES; w++)
+            if (*w >= s.ret_lo && *w < s.ret_hi)
+                frames[n++] = *w;
+    }
+    samples[used] = s.pc;
+    samples[used + 1] = n;
+    used += 2 + n;
+}
+
+
+std::string Profiler::function_of(uint64_t vm_addr) const
+{
+    if (vm_addr == ExecutionEngine::UNKNOWN_ADDR)
+        return "[host]";
+
+    const std::vector<uint64_t>& starts = engine->function_labels.empty() ? engine->call_targets : engine->function_labels;
+    auto f = std::upper_bound(starts.begin(), starts.end(), vm_addr);
+    return engine->label_of(f != starts.begin() ? *(f - 1) : 0);
+}
+
+
+void Profiler::install_sample_handler()
+{
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        // On the fault handler stack, as the VM stack may be the one in use.
+        struct sigaction sa = {};
+        sa.sa_sigaction = handle_sample;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, &prev_sigprof_action) != 0)
+            ABORT("Failed to install the profiling signal handler." << endl);
+    });
+}
+
+
+void Profiler::handle_sample(int sig, siginfo_t* info, void* ctx)
+{
+    Profiler* profiler = sampling_profiler;
+    if (profiler == nullptr) {
+        // Not ours; hand it to whoever was there before.
+        const struct sigaction& prev = prev_sigprof_action;
+        if (prev.sa_flags & SA_SIGINFO) {
+            prev.sa_sigaction(sig, info, ctx);
+        } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+            prev.sa_handler(sig);
+        }
+        return;
+    }
+
+    profiler->take_sample(ctx);
+}
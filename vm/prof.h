@@ -0,0 +1,72 @@
+#pragma once
+
+
+#include <csignal>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include "exe.h"
+
+
+/* A sampling profiler for any engine, with VM_PROFILE.
+ *
+ * While the program runs, a timer on the CPU time of the thread running it
+ * raises SIGPROF every SAMPLE_PERIOD_NS. The handler asks the engine where
+ * the program is and copies the words on the VM stack that fall where return
+ * addresses do into a buffer allocated up front; a sample that no longer
+ * fits is dropped and counted. Only the top MAX_SCAN_WORDS of the stack are
+ * looked at, for at most MAX_FRAMES frames, which keeps each sample to a few
+ * microseconds.
+ *
+ * Nothing is mapped back to the program until the run ends. The stack is
+ * scanned conservatively, so of the words copied only those that map to an
+ * address right after a VM call count as frames. Under the interpreter,
+ * return addresses are small numbers, and data that happens to equal one
+ * makes for a spurious frame.
+ *
+ * Frames are named after the function the call is in: what starts at a
+ * label that is not local, or at a call target without labels. The PC is
+ * named after its function in the folded stacks, and after its own address
+ * in the flat profile.
+ */
+class Profiler final {
+public:
+    explicit Profiler(ExecutionEngine* engine);
+    ~Profiler();
+
+    static void set_output(const char* prefix)      { output = prefix != nullptr ? prefix : ""; }
+
+    void start();
+    void stop();
+    void report();
+
+private:
+    static constexpr long SAMPLE_PERIOD_NS          = 1000000;
+    static constexpr size_t MAX_SAMPLE_WORDS        = 1 << 22;
+    static constexpr size_t MAX_SCAN_WORDS          = 1 << 12;
+    static constexpr size_t MAX_FRAMES              = 128;
+
+    static std::string                              output;
+
+    ExecutionEngine                                 *engine;
+
+    // Samples, one after the other: the PC, the number of frames, then the
+    // frames, innermost first, all as the engine sampled them.
+    std::unique_ptr<uint64_t[]>                     samples;
+    size_t                                          used;
+    uint64_t                                        taken;
+    uint64_t                                        dropped;
+
+#ifdef __linux__
+    timer_t                                         timer;
+#endif
+    bool                                            running;
+    long                                            next_sample_ns;
+
+    void take_sample(const void* ctx);
+    std::string function_of(uint64_t vm_addr) const;
+
+    static void install_sample_handler();
+    static void handle_sample(int sig, siginfo_t* info, void* ctx);
+};
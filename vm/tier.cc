@@ -0,0 +1,178 @@
+#include "vm.h"
+#include "tier.h"
+
+
+TieredEngine::TieredEngine(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: ExecutionEngine(prog, prog_size, mem_size_mb, vm_flags, debug)
+, interp(new Interpreter(prog, prog_size, mem_size_mb, vm_flags | VM_FUEL, debug))
+, jit(new class x86_64JIT(prog, prog_size, mem_size_mb, vm_flags & (VM_HUGE_PAGES | VM_PERF_MAP | VM_JITDUMP | VM_CALL_GRAPH), debug))
+, tiering(!(vm_flags & (VM_STATS | VM_FUEL)))
+, jitted(false)
+, slices(0)
+, compiled(false)
+{
+    jit->tiered = true;
+
+    DBG("\ttype 'tiered'" << endl);
+}
+
+
+TieredEngine::~TieredEngine()
+{
+    wait_for_compiler();
+}
+
+
+void TieredEngine::init_execution()
+{
+    jit->init_execution();
+    interp->init_execution();
+    if (vm_flags & VM_STATS)
+        interp->verify_program();
+
+    interp->data_base = 0;
+    interp->reg[SP] = (uint64_t) jit->stack;
+    interp->ret_base = (uint64_t) jit->ret_pads;
+    // Calls made in one engine may return in the other.
+    interp->call_graph = jit->call_graph = call_graph;
+
+    samples.clear();
+    slices = 0;
+}
+
+
+void TieredEngine::load_program()
+{
+    interp->load_program();
+}
+
+
+bool TieredEngine::exec_program()
+{
+    if (!tiering) {
+        interp->fuel = fuel;
+        return interp->exec_program();
+    }
+
+    for (;;) {
+        interp->fuel = SAMPLE_PERIOD;
+        if (interp->exec_program())
+            return true;
+        slices++;
+
+        // Stopped at a call or back-edge target; PC is where it leads.
+        uint64_t addr = interp->reg[PC];
+        if (compiled.load(std::memory_order_acquire)) {
+            if (enter_jit(addr))
+                return true;
+        } else if (addr < prog_size && ++samples[addr] >= HOT_SAMPLES && !compiler.joinable()
+                   && slices * SAMPLE_PERIOD * BYTES_PER_FUEL >= prog_size) {
+            start_compiling(addr);
+        }
+    }
+}
+
+
+void TieredEngine::fini_execution()
+{
+    wait_for_compiler();
+    jit->fini_execution();
+    interp->fini_execution();
+}
+
+
+bool TieredEngine::owns_fault(const fault_t& fault) const
+{
+    return jitted ? jit->owns_fault(fault) : interp->owns_fault(fault);
+}
+
+
+uint64_t TieredEngine::fault_vm_pc(const fault_t& fault) const
+{
+    return jitted ? jit->fault_vm_pc(fault) : interp->fault_vm_pc(fault);
+}
+
+
+uint64_t TieredEngine::fault_vm_addr(const fault_t& fault) const
+{
+    return jitted ? jit->fault_vm_addr(fault) : interp->fault_vm_addr(fault);
+}
+
+
+void TieredEngine::collect_stats()
+{
+    interp->collect_stats();
+    exec_counts = interp->exec_counts;
+    fusion_counts = interp->fusion_counts;
+}
+
+
+size_t TieredEngine::code_size() const
+{
+    return interp->code_size() + (compiled.load(std::memory_order_acquire) ? jit->code_size() : 0);
+}
+
+
+size_t TieredEngine::peak_mapped_size() const
+{
+    // Both engines keep their memory for the whole run.
+    return interp->peak_mapped_size() + jit->peak_mapped_size();
+}
+
+
+void TieredEngine::sample(const void* ctx, sample_t& s) const
+{
+    if (jitted)
+        jit->sample(ctx, s);
+    else
+        interp->sample(ctx, s);
+}
+
+
+uint64_t TieredEngine::sampled_vm_addr(uint64_t addr)
+{
+    // The interpreter samples VM addresses, the JIT code host addresses;
+    // both return to the return pads.
+    return addr < prog_size ? addr : jit->sampled_vm_addr(addr);
+}
+
+
+void TieredEngine::start_compiling(uint64_t hot_addr)
+{
+    DBG("Compiling in the background, " << HEX_0(hot_addr) << " is hot ..." << endl);
+    compiler = std::thread([this] {
+        jit->init_codegen();
+        jit->load_program();
+        compiled.store(true, std::memory_order_release);
+    });
+}
+
+
+void TieredEngine::wait_for_compiler()
+{
+    if (compiler.joinable())
+        compiler.join();
+}
+
+
+bool TieredEngine::enter_jit(uint64_t vm_addr)
+{
+    // JIT code keeps the flags in host flags, which cannot be handed over.
+    uint64_t aa = jit->as_arch_addr(vm_addr);
+    if (vm_addr == SYS_ENTER_ADDR || aa == (uint64_t) -1 || jit->flags_live_at(vm_addr))
+        return false;
+
+    DBG("Switching to JIT code at " << HEX_0(vm_addr) << " ..." << endl);
+
+    // reg_dump_area holds R0..R12, then SP; resume_stub returns to aa.
+    uint64_t* regs = jit->reg_dump_area.get();
+    for (uint8_t r = R0; r <= R12; r++)
+        regs[r] = interp->reg[r];
+    uint64_t* sp = (uint64_t*) interp->reg[SP];
+    *--sp = aa;
+    regs[R12 + 1] = (uint64_t) sp;
+
+    jitted = true;
+    jit->suspended = true;
+    return jit->exec_program();
+}
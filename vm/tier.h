@@ -0,0 +1,77 @@
+#pragma once
+
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "exe.h"
+#include "int.h"
+#include "x64.h"
+
+
+/* Runs the program in the interpreter and switches it over to x86_64 JIT code
+ * once it proves long-running; short jobs never pay for compiling.
+ *
+ * The interpreter is driven in slices of SAMPLE_PERIOD units of fuel, so it
+ * stops at a function entry or a loop header every so often. Each stop counts
+ * against that address; the first one to reach HOT_SAMPLES starts compiling
+ * in the background, provided the run has lasted long enough to pay for it.
+ * The JIT only compiles whole programs, so the whole program is compiled at
+ * that point, and the bigger the program the longer that takes. Once the
+ * code is ready, the next stop whose block does not read the flags hands the
+ * registers over and the rest of the run is JIT code.
+ *
+ * For the handover to need no translation, the interpreter is set up the
+ * way the JIT code runs: data addresses are host addresses, the stack is the
+ * JIT's data memory, and calls push the address of a return pad in the JIT's
+ * text memory, which jumps on to the code for the VM address returned to.
+ * Like the JITs, this leaves the program text unaddressable.
+ *
+ * With VM_STATS or VM_FUEL the program stays in the interpreter.
+ */
+class TieredEngine final : public ExecutionEngine {
+public:
+    TieredEngine(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
+    ~TieredEngine() override;
+
+private:
+    static constexpr uint64_t SAMPLE_PERIOD         = 1024;
+    static constexpr uint32_t HOT_SAMPLES           = 8;
+    // Program bytes the JIT compiles in the time the interpreter burns a
+    // unit of fuel; bigger programs must run longer before compiling pays.
+    static constexpr uint64_t BYTES_PER_FUEL        = 2;
+
+    std::unique_ptr<Interpreter>                    interp;
+    std::unique_ptr<class x86_64JIT>                jit;
+    bool                                            tiering;
+    bool                                            jitted;
+    uint64_t                                        slices;
+
+    // Stops per address; only call and back-edge targets ever get any.
+    std::unordered_map<uint64_t, uint32_t>          samples;
+    std::thread                                     compiler;
+    std::atomic<bool>                               compiled;
+
+    void init_execution() override;
+    void load_program() override;
+    bool exec_program() override;
+    void fini_execution() override;
+
+    bool owns_fault(const fault_t& fault) const override;
+    uint64_t fault_vm_pc(const fault_t& fault) const override;
+    uint64_t fault_vm_addr(const fault_t& fault) const override;
+
+    void collect_stats() override;
+    size_t code_size() const override;
+    size_t peak_mapped_size() const override;
+
+    void sample(const void* ctx, sample_t& s) const override;
+    uint64_t sampled_vm_addr(uint64_t addr) override;
+
+    void start_compiling(uint64_t hot_addr);
+    void wait_for_compiler();
+    bool enter_jit(uint64_t vm_addr);
+};
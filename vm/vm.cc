@@ -1,4 +1,5 @@
 #include <cstddef>
+#include <cstdlib>
 #include <memory>
 
 #include "vm.h"
@@ -6,11 +7,14 @@
 #include "int.h"
 #include "a64.h"
 #include "x64.h"
+#include "tier.h"
+#include "prof.h"
+#include "cg.h"
 
 
 static size_t adjust_mem_size_mb(size_t mem_size_mb);
 static ExecutionEngine* create_execution_engine(
-    const void* prog, size_t prog_size, size_t mem_size_mb, exec_type_t exec_type, bool debug);
+    const void* prog, size_t prog_size, size_t mem_size_mb, exec_type_t exec_type, uint32_t flags, bool debug);
 
 
 extern "C"
@@ -22,14 +26,146 @@ void vm_run(
     bool debug
 )
 {
-    std::unique_ptr<ExecutionEngine>(
+    // Its callers cannot see a status; as ever, a run that fails, having
+    // reported why, does not return.
+    if (vm_run_ex(prog, prog_size, mem_size_mb, exec_type, 0, debug, nullptr) != VM_OK)
+        std::abort();
+}
+
+
+extern "C"
+vm_status_t vm_run_ex(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug,
+    vm_result_t* result
+)
+{
+    return std::unique_ptr<ExecutionEngine>(
+        create_execution_engine(
+            prog,
+            prog_size,
+            adjust_mem_size_mb(mem_size_mb),
+            exec_type,
+            flags,
+            debug
+    ))->execute(result);
+}
+
+
+extern "C"
+vm_status_t vm_run_timed(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug,
+    vm_result_t* result,
+    vm_phase_stats_t* phases
+)
+{
+    std::unique_ptr<ExecutionEngine> engine(
         create_execution_engine(
             prog,
             prog_size,
             adjust_mem_size_mb(mem_size_mb),
             exec_type,
+            flags,
             debug
-    ))->execute();
+    ));
+    vm_status_t status = engine->execute(result);
+    if (phases != nullptr)
+        *phases = engine->get_phase_stats();
+    return status;
+}
+
+
+extern "C"
+vm_t* vm_create(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug
+)
+{
+    return reinterpret_cast<vm_t*>(
+        create_execution_engine(
+            prog,
+            prog_size,
+            adjust_mem_size_mb(mem_size_mb),
+            exec_type,
+            flags,
+            debug
+    ));
+}
+
+
+extern "C"
+vm_status_t vm_resume(vm_t* vm, uint64_t fuel, vm_result_t* result)
+{
+    return reinterpret_cast<ExecutionEngine*>(vm)->run(fuel, result);
+}
+
+
+extern "C"
+void vm_destroy(vm_t* vm)
+{
+    ExecutionEngine* engine = reinterpret_cast<ExecutionEngine*>(vm);
+    engine->stop();
+    delete engine;
+}
+
+
+extern "C"
+void vm_free_result(vm_result_t* result)
+{
+    delete[] result->stats.blocks;
+    result->stats.blocks = nullptr;
+    result->stats.num_blocks = 0;
+    delete[] result->stats.fusions;
+    result->stats.fusions = nullptr;
+    result->stats.num_fusions = 0;
+}
+
+
+extern "C"
+void vm_set_jit_cache_dir(const char* dir)
+{
+    JIT::set_cache_dir(dir);
+}
+
+
+extern "C"
+void vm_set_jit_threads(size_t threads)
+{
+    JIT::set_threads(threads);
+}
+
+
+extern "C"
+void vm_set_labels(const char* labels_file)
+{
+    ExecutionEngine::set_labels_file(labels_file);
+}
+
+
+extern "C"
+void vm_set_profile_output(const char* prefix)
+{
+    Profiler::set_output(prefix);
+}
+
+
+extern "C"
+void vm_set_call_graph_output(const char* prefix)
+{
+    CallGraph::set_output(prefix);
 }
 
 
@@ -43,15 +179,17 @@ static size_t adjust_mem_size_mb(size_t mem_size_mb)
 
 
 static ExecutionEngine* create_execution_engine(
-    const void* prog, size_t prog_size, size_t mem_size_mb, exec_type_t exec_type, bool debug)
+    const void* prog, size_t prog_size, size_t mem_size_mb, exec_type_t exec_type, uint32_t flags, bool debug)
 {
     switch (exec_type) {
     case INTERPRETER:
-        return new Interpreter(prog, prog_size, mem_size_mb, debug);
+        return new Interpreter(prog, prog_size, mem_size_mb, flags, debug);
     case AArch64JIT:
-        return new class AArch64JIT(prog, prog_size, mem_size_mb, debug);
+        return new class AArch64JIT(prog, prog_size, mem_size_mb, flags, debug);
     case x86_64JIT:
-        return new class x86_64JIT(prog, prog_size, mem_size_mb, debug);
+        return new class x86_64JIT(prog, prog_size, mem_size_mb, flags, debug);
+    case TIERED:
+        return new TieredEngine(prog, prog_size, mem_size_mb, flags, debug);
     default:
         ABORT("Unsupported execution type ID '" << exec_type << "'." << endl);
     }
@@ -8,10 +8,93 @@
 typedef enum : uint8_t {
     INTERPRETER = 1,
     AArch64JIT  = 2,
-    x86_64JIT   = 3
+    x86_64JIT   = 3,
+    TIERED      = 4
 } exec_type_t;
 
 
+typedef enum : uint32_t {
+    VM_HUGE_PAGES = 0x1,
+    VM_STATS      = 0x2,
+    VM_FUEL       = 0x4,
+    VM_LAZY_JIT   = 0x8,
+    VM_PERF_MAP   = 0x10,
+    VM_JITDUMP    = 0x20,
+    VM_PROFILE    = 0x40,
+    VM_CALL_GRAPH = 0x80,
+    VM_TIMINGS    = 0x100
+} vm_flag_t;
+
+
+typedef enum : uint8_t {
+    VM_OK           = 0,
+    VM_FAULT        = 1,
+    VM_INVALID      = 2,
+    VM_OUT_OF_FUEL  = 3
+} vm_status_t;
+
+
+#define VM_NUM_OPCODES 64
+
+
+typedef struct {
+    uint64_t            addr;
+    uint64_t            count;
+} vm_block_stats_t;
+
+
+typedef struct {
+    const char*         name;
+    uint64_t            sites;
+    uint64_t            hits;
+} vm_fusion_stats_t;
+
+
+/* Instructions the interpreter ran fused into superinstructions still count
+ * as themselves; fusions has how many places each superinstruction was made
+ * at and how often it ran, and is empty for the JITs.
+ */
+typedef struct {
+    uint64_t            instructions;
+    uint64_t            opcodes[VM_NUM_OPCODES];
+    size_t              num_blocks;
+    vm_block_stats_t*   blocks;
+    size_t              num_fusions;
+    vm_fusion_stats_t*  fusions;
+} vm_stats_t;
+
+
+/* What running a program cost, phase by phase, in nanoseconds of wall time:
+ * checking it, setting up the engine, loading it, which is where the JITs
+ * compile it, running it, over all the slices it ran in, and tearing the
+ * engine down. TIERED compiles in the background while the program runs.
+ * code_bytes is the size of the code the engine ran the program as: host
+ * code for the JITs, decoded instructions for the interpreter, both for
+ * TIERED once it has compiled. peak_mapped_bytes is the most memory the
+ * engine had mapped for code and data at once, guard pages aside.
+ */
+typedef struct {
+    uint64_t            verify_ns;
+    uint64_t            init_ns;
+    uint64_t            load_ns;
+    uint64_t            exec_ns;
+    uint64_t            fini_ns;
+    uint64_t            code_bytes;
+    uint64_t            peak_mapped_bytes;
+} vm_phase_stats_t;
+
+
+typedef struct {
+    vm_status_t         status;
+    uint64_t            fault_pc;
+    uint64_t            fault_addr;
+    vm_stats_t          stats;
+} vm_result_t;
+
+
+/* Runs the program to the end. A program that fails aborts the process,
+ * once the reason is printed.
+ */
 extern "C"
 void vm_run(
     const void* prog,
@@ -20,3 +103,120 @@ void vm_run(
     exec_type_t exec_type,
     bool debug
 );
+
+
+/* Same as vm_run(), with vm_flag_t flags, but returns how the program ended
+ * instead of aborting and, unless result is nullptr, fills in *result.
+ * Statistics are only collected with VM_STATS; release them with
+ * vm_free_result().
+ */
+extern "C"
+vm_status_t vm_run_ex(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug,
+    vm_result_t* result
+);
+
+
+/* Same as vm_run_ex(), also filling in *phases once the program has
+ * finished. With VM_TIMINGS, any way of running a program also prints them
+ * to stderr when it finishes, as one line of JSON.
+ */
+extern "C"
+vm_status_t vm_run_timed(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug,
+    vm_result_t* result,
+    vm_phase_stats_t* phases
+);
+
+
+extern "C"
+void vm_free_result(vm_result_t* result);
+
+
+/* Keeps JIT code in dir, created if missing, for later runs of the same
+ * program to load instead of compiling it again; nullptr stops that. Only
+ * the x86_64 JIT, and TIERED through it, use the cache, and not with
+ * VM_LAZY_JIT. Applies to engines created afterwards.
+ */
+extern "C"
+void vm_set_jit_cache_dir(const char* dir);
+
+
+/* Sets how many threads the x86_64 JIT compiles a program on, splitting it
+ * at function boundaries: 1 compiles on the calling thread, 0 (the default)
+ * uses up to one per core for programs large enough to gain from it.
+ * Applies to engines created afterwards.
+ */
+extern "C"
+void vm_set_jit_threads(size_t threads);
+
+
+/* Names VM addresses after the labels file tools/asm.py -l writes, wherever
+ * the VM reports on code: in the perf map (VM_PERF_MAP) and jitdump
+ * (VM_JITDUMP) of the JITs, which describe their code to Linux perf as
+ * /tmp/perf-<pid>.map and /tmp/jit-<pid>.dump, one symbol per label, or
+ * per basic block without labels. nullptr goes back to bare addresses.
+ * Applies to engines created afterwards.
+ */
+extern "C"
+void vm_set_labels(const char* labels_file);
+
+
+/* With VM_PROFILE, the program is sampled on a CPU time timer as it runs,
+ * in any engine, and when it finishes the samples are written to
+ * <prefix>.flat, by VM address, and <prefix>.folded, as folded stacks of
+ * functions for flame graph tools; both named after the labels given to
+ * vm_set_labels(). The prefix defaults to /tmp/vm-<pid>; nullptr goes back
+ * to that. Applies to programs that finish afterwards.
+ */
+extern "C"
+void vm_set_profile_output(const char* prefix);
+
+
+/* With VM_CALL_GRAPH, every call and return the program makes is timed in
+ * cycles, in any engine, and when it finishes the calls and the cycles spent
+ * in each function, with and without its callees, are written to
+ * <prefix>.calls, and the cycles by call path to <prefix>.calls.folded, as
+ * folded stacks for flame graph tools; both named after the labels given to
+ * vm_set_labels(). The prefix defaults to /tmp/vm-<pid>; nullptr goes back
+ * to that. Applies to programs that finish afterwards.
+ */
+extern "C"
+void vm_set_call_graph_output(const char* prefix);
+
+
+/* Resumable execution. vm_resume() runs the program for up to `fuel` units
+ * (0 meaning no limit; the budget only applies with VM_FUEL) and returns
+ * VM_OUT_OF_FUEL if it has not finished yet, in which case it may be called
+ * again to carry on. The program must stay valid until vm_destroy().
+ */
+typedef struct vm_s vm_t;
+
+
+extern "C"
+vm_t* vm_create(
+    const void* prog,
+    size_t prog_size,
+    size_t mem_size_mb,
+    exec_type_t exec_type,
+    uint32_t flags,
+    bool debug
+);
+
+
+extern "C"
+vm_status_t vm_resume(vm_t* vm, uint64_t fuel, vm_result_t* result);
+
+
+extern "C"
+void vm_destroy(vm_t* vm);
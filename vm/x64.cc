@@ -1,23 +1,32 @@
 #include <algorithm>
 #include <map>
+#include <memory>
+#include <thread>
+#include <ucontext.h>
 
 #include "exe.h"
 #include "x64.h"
+#include "cg.h"
 
 
-#define JIT_NEXT(OFFSET) { \
-    uint64_t va = jpos.vm - (uint8_t*) prog; \
-    idd.addr = va; \
-    va2idd[va] = idd; \
-    jpos.vm += OFFSET; \
-    return; \
-}
-#define DEFER_JIT_AND_RESERVE_SLOTS(SLOTS) { \
-    { \
-        deferred_jpos.push_back(jpos); \
-        for(size_t i = 0; i < SLOTS; i++) \
-            emit_nop(); \
+#define JIT_JCC(JCC, JCC_UC) { \
+    uint64_t va = as_arch_addr(idd.ivu); \
+    if (va != (uint64_t) -1) { \
+        int64_t rel = (int64_t) va - (int64_t) jpos.arch; \
+        if (fits_rel8(rel, sizeof(JCC_UC##_IMM8))) \
+            emit_##JCC##_imm8((int8_t) rel); \
+        else \
+            emit_##JCC##_imm32((int32_t) rel); \
+    } \
+    else if (is_short_branch()) { \
+        emit_##JCC##_imm8(0); \
+        record_fixup(FIXUP_REL8, idd.ivu); \
     } \
+    else { \
+        emit_##JCC##_imm32(0); \
+        record_fixup(FIXUP_REL32, idd.ivu, sizeof(JCC_UC##_IMM32) - sizeof(JCC_UC##_IMM8)); \
+    } \
+    return; \
 }
 
 
@@ -40,20 +49,51 @@ const std::map<x86_64JIT::vm_reg_t, x86_64JIT::arch_reg_t> x86_64JIT::vr2ar = {
 };
 
 
-x86_64JIT::x86_64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug)
-: JIT(prog, prog_size, mem_size_mb, debug)
+x86_64JIT::x86_64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug)
+: JIT(prog, prog_size, mem_size_mb, vm_flags, debug)
+, host_sp(0), vm_sp(0)
+, lazy_stub(nullptr), lazy_exit(nullptr)
+, enter_stub(nullptr), leave_stub(nullptr)
 {
+    lazy = vm_flags & VM_LAZY_JIT;
+    relocatable = true;
     DBG("\ttype 'x86_64 JIT'" << endl);
 }
 
 
+x86_64JIT::x86_64JIT(x86_64JIT* owner)
+: JIT(owner->prog, owner->prog_size, owner->mem_size >> 20, owner->vm_flags, false)
+, host_sp(0), vm_sp(0)
+, lazy_stub(nullptr), lazy_exit(nullptr)
+, enter_stub(owner->enter_stub), leave_stub(owner->leave_stub)
+{
+    relocatable = true;
+    work_for(owner);
+}
+
+
 void x86_64JIT::jit()
 {
     emit_vm_sub_entry_seq_from_host();
     emit_sys_enter_stub();
+    emit_fuel_stubs();
+    emit_tier_entry_stub();
+    emit_lazy_stubs();
+    emit_call_graph_stubs();
     emit_reg_init();
 
-    jit_program();
+    if (lazy) {
+        // The code for the entry point follows on from the register setup.
+        jit_lazily(jpos.vm - (const uint8_t*) prog);
+        return;
+    }
+
+    // A second pass lays the runs of a first parallel one out; if the first
+    // pass was serial, so is the second.
+    size_t threads = jit_threads();
+    if (threads < 2 || (!short_branches.empty() && run_sizes.empty()) || !jit_in_parallel(threads))
+        jit_program();
+    emit_ret_pads();
 
     emit_vm_exit_syscall_guard();
 }
@@ -63,18 +103,233 @@ void x86_64JIT::jit_program()
 {
     DBG("JITing program..." << endl);
 
-    while (jpos.vm < ((uint8_t*) prog) + prog_size) {
+    for (const ir_instr_t& ins : ir) {
+        // The sys_enter stub stands in for the instructions it replaced.
+        if ((const uint8_t*) prog + ins.idd.addr < jpos.vm)
+            continue;
+        jpos.vm = (const uint8_t*) prog + ins.idd.addr;
         record_addr_mapping();
-        jit_vm_instruction();
+        emit_block_count(ins.idd.addr);
+        emit_fuel_check(ins.idd.addr);
+        jit_vm_instruction(ins);
     }
-    jit_deferred();
+    jpos.vm = (const uint8_t*) prog + prog_size;
+    resolve_fixups();
 }
 
 
-void x86_64JIT::jit_vm_instruction()
+size_t x86_64JIT::jit_threads() const
+{
+    if (num_threads != 0)
+        return num_threads;
+    if (ir.size() < PARALLEL_MIN_INSTRS)
+        return 1;
+    return std::min<size_t>(std::thread::hardware_concurrency(), MAX_JIT_THREADS);
+}
+
+
+bool x86_64JIT::jit_in_parallel(size_t num_runs)
+{
+    /* Split the program into runs of whole functions, with about as many
+     * instructions each, a call target starting a function. Each run is
+     * JITed by a worker on a thread of its own, into a region of its own.
+     * A first pass shares out the text memory left in proportion to the
+     * instructions; if the branches it made short call for a second pass,
+     * that one packs the runs back to back in the size they took in the
+     * first, which they can only shrink from. Branches between runs are
+     * linked last.
+     */
+    uint64_t vm_start = jpos.vm - (const uint8_t*) prog;
+    size_t first = std::lower_bound(ir.begin(), ir.end(), vm_start,
+        [](const ir_instr_t& ins, uint64_t addr) { return ins.idd.addr < addr; }) - ir.begin();
+    size_t n = ir.size() - first;
+
+    std::vector<bool> called(prog_size, false);
+    for (const ir_instr_t& ins : ir)
+        if (ins.op == CALL && ins.idd.ivu < prog_size)
+            called[ins.idd.ivu] = true;
+    std::vector<size_t> bounds = { first };
+    for (size_t i = first + 1; i < ir.size() && bounds.size() < num_runs; i++)
+        if (called[ir[i].idd.addr] && i - first >= bounds.size() * n / num_runs)
+            bounds.push_back(i);
+    bounds.push_back(ir.size());
+    size_t runs = bounds.size() - 1;
+    bool packed = !run_sizes.empty();
+    if (runs < 2 || (packed && run_sizes.size() != runs))
+        return false;
+
+    std::vector<uint8_t*> starts(runs + 1);
+    starts[0] = jpos.arch;
+    for (size_t r = 0; r < runs; r++)
+        starts[r + 1] = starts[r] + (packed ? run_sizes[r] : (text_limit - jpos.arch) * (bounds[r + 1] - bounds[r]) / n);
+
+    std::vector<std::unique_ptr<x86_64JIT>> workers;
+    for (size_t r = 0; r < runs; r++) {
+        workers.emplace_back(new x86_64JIT(this));
+        workers[r]->jpos.arch = starts[r];
+        workers[r]->span_begin = ir[bounds[r]].idd.addr;
+        workers[r]->span_end = bounds[r + 1] < ir.size() ? ir[bounds[r + 1]].idd.addr : prog_size;
+    }
+    std::vector<uint8_t> done(runs, false);
+    auto work = [&](size_t r) {
+        done[r] = workers[r]->jit_run(ir.data() + bounds[r], ir.data() + bounds[r + 1], starts[r + 1], !packed);
+    };
+    std::vector<std::thread> threads;
+    for (size_t r = 1; r < runs; r++)
+        threads.emplace_back(work, r);
+    work(0);
+    for (std::thread& t : threads)
+        t.join();
+    if (std::count(done.begin(), done.end(), false) != 0) {
+        DBG("\tNot enough text memory to JIT in parallel" << endl);
+        return false;
+    }
+
+    // Link: whatever a worker left unresolved is elsewhere.
+    for (size_t r = 0; r < runs; r++) {
+        if (!packed)
+            run_sizes.push_back(workers[r]->jpos.arch - starts[r]);
+        fixups.insert(fixups.end(), workers[r]->fixups.begin(), workers[r]->fixups.end());
+        relocs.insert(relocs.end(), workers[r]->relocs.begin(), workers[r]->relocs.end());
+    }
+    std::sort(fixups.begin(), fixups.end(), [](const fixup_t& a, const fixup_t& b) { return a.arch < b.arch; });
+    jpos.arch = workers.back()->jpos.arch;
+    jpos.vm = (const uint8_t*) prog + prog_size;
+    resolve_fixups();
+
+    DBG("\tJITed " << runs << " runs of functions in parallel" << endl);
+    return true;
+}
+
+
+bool x86_64JIT::jit_run(const ir_instr_t* first, const ir_instr_t* last, uint8_t* limit, bool check)
+{
+    for (const ir_instr_t* ins = first; ins < last; ins++) {
+        if (check && limit - jpos.arch < (ptrdiff_t) MAX_INSTR_CODE)
+            return false;
+        jpos.vm = (const uint8_t*) prog + ins->idd.addr;
+        record_addr_mapping();
+        emit_block_count(ins->idd.addr);
+        emit_fuel_check(ins->idd.addr);
+        jit_vm_instruction(*ins);
+    }
+
+    // Runs are laid out apart, so running off the end of one takes a jump
+    // to the next, or to the exit after the last one.
+    uint8_t op = (last - 1)->op;
+    if (op != vm_instr_t::JMP && op != vm_instr_t::RET) {
+        if (span_end < prog_size) {
+            emit_jmp_imm32(0);
+            record_fixup(FIXUP_REL32, span_end);
+        } else {
+            emit_vm_exit_syscall_guard();
+        }
+    }
+    if (jpos.arch > limit)
+        ABORT("JIT code overflows the region of its run." << endl);
+    return true;
+}
+
+
+uint64_t x86_64JIT::jit_lazily(uint64_t vm_addr)
+{
+    uint64_t aa = as_arch_addr(vm_addr);
+    if (aa != (uint64_t) -1)
+        return aa;
+
+    // Compile straight-line code from vm_addr up to the first jmp or ret,
+    // the end of the program or code compiled before. Every instruction
+    // stands on its own without the IR passes, so jumps may land anywhere.
+    aa = (uint64_t) jpos.arch;
+    fixups.clear();
+    for (uint64_t addr = vm_addr;;) {
+        if (addr >= prog_size) {
+            emit_jmp_imm64((uint64_t) lazy_exit);
+            break;
+        }
+        uint64_t next = as_arch_addr(addr);
+        if (next != (uint64_t) -1) {
+            emit_jmp_imm64(next);
+            break;
+        }
+        ir_instr_t ins = decode_ir_instr(addr);
+        jpos.vm = (const uint8_t*) prog + addr;
+        record_addr_mapping();
+        emit_block_count(addr);
+        emit_fuel_check(addr);
+        jit_vm_instruction(ins);
+        addr += ins.len;
+        if (ins.op == vm_instr_t::JMP || ins.op == vm_instr_t::RET)
+            break;
+    }
+
+    // Branches to code not compiled yet go through a stub of their own,
+    // a call to lazy_stub followed by the index of the branch.
+    for (const fixup_t& fixup : fixups) {
+        uint64_t target = as_arch_addr(fixup.vm_target);
+        if (target == (uint64_t) -1) {
+            target = (uint64_t) jpos.arch;
+            emit_call_imm32(lazy_stub - jpos.arch);
+            *((uint32_t*) jpos.arch) = lazy_sites.size();
+            jpos.arch += 4;
+            lazy_sites.push_back(fixup);
+        }
+        patch_fixup(fixup, (const uint8_t*) target);
+    }
+    fixups.clear();
+
+    if (jpos.arch > text_limit)
+        ABORT("JIT code overflows into the counters at the end of text memory." << endl);
+    return aa;
+}
+
+
+uint64_t* x86_64JIT::jit_lazily_from_stub(uint64_t* sp, x86_64JIT* jit)
+{
+    // Under the flags, the return address of the call in the site stub,
+    // which points at the index of the branch that led there.
+    uint8_t* stub = (uint8_t*) sp[1] - sizeof(CALL_IMM32);
+    fixup_t site = jit->lazy_sites[*((uint32_t*) sp[1])];
+    uint8_t* begin = jit->jpos.arch;
+    uint64_t aa = jit->jit_lazily(site.vm_target);
+    jit->describe_code(begin, jit->jpos.arch);
+
+    // Both the branch and its stub now go straight to the code.
+    jit->patch_fixup(site, (const uint8_t*) aa);
+    uint8_t* pos = jit->jpos.arch;
+    jit->jpos.arch = stub;
+    jit->emit_jmp_imm32((int32_t) (aa - (uint64_t) stub));
+    jit->jpos.arch = pos;
+
+    sp[1] = aa;
+    return sp;
+}
+
+
+uint64_t* x86_64JIT::call_entered_from_stub(uint64_t* sp, x86_64JIT* jit)
+{
+    // Under the flags, the return address of the call to the stub, which
+    // points at the VM address called; the call itself follows it, and
+    // pushes its return address right above.
+    const uint32_t* vm_target = (const uint32_t*) sp[1];
+    sp[1] += sizeof(uint32_t);
+    jit->call_graph->enter(*vm_target, sp + 1);
+    return sp;
+}
+
+
+uint64_t* x86_64JIT::call_left_from_stub(uint64_t* sp, x86_64JIT* jit)
+{
+    // The ret takes the return address above the one of the call to the stub.
+    jit->call_graph->leave(sp + 2);
+    return sp;
+}
+
+
+void x86_64JIT::jit_vm_instruction(const ir_instr_t& ins)
 {
     static void* instr_jit_handle[] = {
-        nullptr,
+        &&_nop,
         &&_load,
         &&_store,
         &&_mov,
@@ -98,260 +353,199 @@ void x86_64JIT::jit_vm_instruction()
         &&_jmple,
     };
 
-    instr_decode_data_t idd = { 0, 0, 0, 0, 0, 0, 0 };
+    const instr_decode_data_t& idd = ins.idd;
+
+    goto *instr_jit_handle[ins.op];
 
-    goto *instr_jit_handle[instr(*jpos.vm)];
+    _nop:
+        return;
 
     _load: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
-        idd.src = reg_src(*(jpos.vm + 1));
-        idd.idx = imm16s(*(jpos.vm + 2));
         emit_mov_reg_b32d(as_arch_reg(idd.dst), as_arch_reg(idd.src), idd.idx);
-        JIT_NEXT(+4);
+        return;
     }
 
     _store: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
-        idd.src = reg_src(*(jpos.vm + 1));
-        idd.idx = imm16s(*(jpos.vm + 2));
         emit_mov_b32d_reg(as_arch_reg(idd.dst), idd.idx, as_arch_reg(idd.src));
-        JIT_NEXT(+4);
+        return;
     }
 
     _mov: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_mov_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_mov_reg_imm(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _add: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_add_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_add_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _sub: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_sub_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_sub_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _and: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_and_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_and_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _or: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_or_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_or_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _xor: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_xor_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_xor_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _not: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_not_reg(as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _cmp: {
-        idd.am = access_mode(*jpos.vm);
-        idd.dst = reg_dst(*(jpos.vm + 1));
         switch (idd.am) {
         case REG:
-            idd.src = reg_src(*(jpos.vm + 1));
             emit_cmp_reg_reg(as_arch_reg(idd.dst), as_arch_reg(idd.src));
-            JIT_NEXT(+2);
+            return;
         case IMM:
-            idd.ivs = imm64s(*(jpos.vm + 2));
             emit_cmp_reg_imm64(as_arch_reg(idd.dst), idd.ivs);
-            JIT_NEXT(+10);
+            return;
         }
     }
 
     _push: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_push_reg(as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _pop: {
-        idd.dst = reg_dst(*(jpos.vm + 1));
         emit_pop_reg(as_arch_reg(idd.dst));
-        JIT_NEXT(+2);
+        return;
     }
 
     _call: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
+        if ((vm_flags & VM_CALL_GRAPH) && idd.ivu != SYS_ENTER_ADDR) {
+            emit_call_imm32(enter_stub - jpos.arch);
+            *((uint32_t*) jpos.arch) = idd.ivu;
+            jpos.arch += 4;
+        }
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_call_imm64(va);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+13);
+            emit_call_imm32(0);
+            record_fixup(FIXUP_REL32, idd.ivu);
         }
-        JIT_NEXT(+9);
+        return;
     }
 
     _ret: {
+        if (vm_flags & VM_CALL_GRAPH)
+            emit_call_imm32(leave_stub - jpos.arch);
         emit_ret();
-        JIT_NEXT(+1);
+        return;
     }
 
     _jmp: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
         uint64_t va = as_arch_addr(idd.ivu);
         if (va != (uint64_t) -1) {
             emit_jmp_imm64(va);
         }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+13);
-        }
-        JIT_NEXT(+9);
-    }
-
-    _jmpeq: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_je_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
+        else if (is_short_branch()) {
+            emit_jmp_imm8(0);
+            record_fixup(FIXUP_REL8, idd.ivu);
         }
         else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
+            emit_jmp_imm32(0);
+            record_fixup(FIXUP_REL32, idd.ivu, sizeof(JMP_IMM32) - sizeof(JMP_IMM8));
         }
-        JIT_NEXT(+9);
+        return;
     }
 
-    _jmpne: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_jne_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
-        }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
-        }
-        JIT_NEXT(+9);
-    }
+    _jmpeq: JIT_JCC(je, JE)
 
-    _jmpgt: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_jg_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
-        }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
-        }
-        JIT_NEXT(+9);
-    }
+    _jmpne: JIT_JCC(jne, JNE)
 
-    _jmplt: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_jl_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
-        }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
-        }
-        JIT_NEXT(+9);
-    }
+    _jmpgt: JIT_JCC(jg, JG)
 
-    _jmpge: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_jge_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
-        }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
-        }
-        JIT_NEXT(+9);
-    }
+    _jmplt: JIT_JCC(jl, JL)
 
-    _jmple: {
-        idd.ivu = imm64u(*(jpos.vm + 1));
-        uint64_t va = as_arch_addr(idd.ivu);
-        if (va != (uint64_t) -1) {
-            emit_jle_imm32((int32_t) ((int64_t) va - (int64_t) jpos.arch));
-        }
-        else {
-            DEFER_JIT_AND_RESERVE_SLOTS(+6);
-        }
-        JIT_NEXT(+9);
+    _jmpge: JIT_JCC(jge, JGE)
+
+    _jmple: JIT_JCC(jle, JLE)
+}
+
+
+void x86_64JIT::patch_fixup(const fixup_t& fixup, const uint8_t* target)
+{
+    switch (fixup.kind) {
+    case FIXUP_REL8:
+        if (!fits_rel8(target - fixup.arch, 0))
+            ABORT("Branch target out of range." << endl);
+        *((int8_t*) (fixup.arch - 1)) = (int8_t) (target - fixup.arch);
+        break;
+    case FIXUP_REL32:
+        if (!fits_rel32(target - fixup.arch, 0))
+            ABORT("Branch target out of range." << endl);
+        *((int32_t*) (fixup.arch - 4)) = (int32_t) (target - fixup.arch);
+        break;
     }
 }
 
 
-void x86_64JIT::jit_deferred()
+const uint64_t* x86_64JIT::sampled_vm_sp(const void* ctx, bool in_code) const
 {
-    jit_pos_t cur_jpos = jpos;
-    std::for_each(deferred_jpos.begin(), deferred_jpos.end(), [this](jit_pos_t& jp) {
-        jpos = jp;
-        jit_vm_instruction();
-    });
-    jpos = cur_jpos;
+    // Host code runs on the host stack; the VM one is where it was left.
+    if (!in_code)
+        return (const uint64_t*) vm_sp;
+#if defined(__linux__) && defined(__x86_64__)
+    return (const uint64_t*) ((const ucontext_t*) ctx)->uc_mcontext.gregs[REG_RSP];
+#elif defined(__APPLE__) && defined(__x86_64__)
+    return (const uint64_t*) ((const ucontext_t*) ctx)->uc_mcontext->__ss.__rsp;
+#else
+    (void) ctx;
+    return nullptr;
+#endif
 }
 
 
@@ -364,14 +558,14 @@ void x86_64JIT::emit_vm_sub_entry_seq_from_host()
     emit_push_reg(R14);
     emit_push_reg(R15);
 
-    emit_mov_reg_imm(RBP, (uint64_t) &host_sp);
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &host_sp);
     emit_mov_b8d_reg(RBP, 0, RSP);
 }
 
 
 void x86_64JIT::emit_vm_sub_exit_seq_to_host()
 {
-    emit_mov_reg_imm(RBP, (uint64_t) &host_sp);
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &host_sp);
     emit_mov_reg_b8d(RSP, RBP, 0);
 
     emit_pop_reg(R15);
@@ -387,7 +581,7 @@ void x86_64JIT::emit_vm_sub_exit_seq_to_host()
 
 void x86_64JIT::emit_non_vm_sub_entry_seq_to_host()
 {
-    emit_mov_reg_imm(RBP, (uint64_t) &vm_sp);
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &vm_sp);
     emit_mov_b8d_reg(RBP, 0, as_arch_reg(vm_reg_t::SP));
 
     emit_push_reg(R8);
@@ -398,11 +592,15 @@ void x86_64JIT::emit_non_vm_sub_entry_seq_to_host()
     emit_push_reg(RCX);
     emit_push_reg(RDX);
     emit_push_reg(RSI);
+    if (vm_flags & VM_FUEL)
+        emit_push_reg(FUEL_REG);
 }
 
 
 void x86_64JIT::emit_non_vm_sub_exit_seq_to_host()
 {
+    if (vm_flags & VM_FUEL)
+        emit_pop_reg(FUEL_REG);
     emit_pop_reg(RSI);
     emit_pop_reg(RDX);
     emit_pop_reg(RCX);
@@ -412,7 +610,7 @@ void x86_64JIT::emit_non_vm_sub_exit_seq_to_host()
     emit_pop_reg(R9);
     emit_pop_reg(R8);
 
-    emit_mov_reg_imm(RBP, (uint64_t) &vm_sp);
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &vm_sp);
     emit_mov_reg_b8d(as_arch_reg(vm_reg_t::SP), RBP, 0);
 }
 
@@ -426,6 +624,7 @@ void x86_64JIT::emit_sys_enter_stub()
     jpos.arch += sizeof(JMP_IMM32);
     sys_enter_stub = jpos.arch;
     record_addr_mapping();
+    emit_block_count(SYS_ENTER_ADDR);
     emit_mov_reg_b32d(R8, as_arch_reg(vm_reg_t::SP), 8);
     emit_cmp_reg_imm64(R8, 0);
     pj1 = jpos.arch;
@@ -450,9 +649,153 @@ void x86_64JIT::emit_sys_enter_stub()
 }
 
 
+void x86_64JIT::emit_fuel_stubs()
+{
+    if (!(vm_flags & VM_FUEL))
+        return;
+
+    uint8_t *pj0, *pn0;
+
+    pj0 = jpos.arch;
+    jpos.arch += sizeof(JMP_IMM32);
+
+    // The VM stack already holds where to resume, pushed by the call here.
+    yield_stub = jpos.arch;
+    emit_mov_reg_addr(RBP, RELOC_TEXT, fuel_counter);
+    emit_mov_b8d_reg(RBP, 0, FUEL_REG);
+    emit_vm_reg_save_seq();
+    emit_vm_sub_exit_seq_to_host();
+
+    resume_stub = jpos.arch;
+    emit_vm_sub_entry_seq_from_host();
+    emit_vm_reg_restore_seq();
+    emit_mov_reg_addr(RBP, RELOC_TEXT, fuel_counter);
+    emit_mov_reg_b8d(FUEL_REG, RBP, 0);
+    emit_ret();
+    pn0 = jpos.arch;
+
+    jpos.arch = pj0;
+    emit_jmp_imm32(pn0 - pj0);
+    jpos.arch = pn0;
+}
+
+
+void x86_64JIT::emit_tier_entry_stub()
+{
+    if (!tiered)
+        return;
+
+    uint8_t *pj0, *pn0;
+
+    pj0 = jpos.arch;
+    jpos.arch += sizeof(JMP_IMM32);
+
+    // Like resuming after a yield; the VM stack holds where to enter.
+    resume_stub = jpos.arch;
+    emit_vm_sub_entry_seq_from_host();
+    emit_vm_reg_restore_seq();
+    emit_ret();
+    pn0 = jpos.arch;
+
+    jpos.arch = pj0;
+    emit_jmp_imm32(pn0 - pj0);
+    jpos.arch = pn0;
+}
+
+
+void x86_64JIT::emit_ret_pads()
+{
+    if (!tiered)
+        return;
+
+    // Return addresses are at least a call apart, wide enough for a jmp rel32.
+    uint8_t* pos = jpos.arch;
+    for (const ir_instr_t& ins : ir) {
+        if (ins.op != CALL)
+            continue;
+        uint64_t aa = as_arch_addr(ins.idd.addr + ins.len);
+        if (aa == (uint64_t) -1)
+            continue;
+        jpos.arch = ret_pads + ins.idd.addr + ins.len;
+        if (!fits_rel32((int64_t) aa - (int64_t) jpos.arch, sizeof(JMP_IMM32)))
+            ABORT("Return pad out of rel32 reach; use less VM memory." << endl);
+        emit_jmp_imm32((int32_t) ((int64_t) aa - (int64_t) jpos.arch));
+    }
+    jpos.arch = pos;
+}
+
+
+void x86_64JIT::emit_lazy_stubs()
+{
+    if (!lazy)
+        return;
+
+    uint8_t *pj0, *pn0;
+
+    lazy_sites.clear();
+    pj0 = jpos.arch;
+    jpos.arch += sizeof(JMP_IMM32);
+
+    // Where code running off the end of the program goes, as it would
+    // fall into the guard after the whole program otherwise.
+    lazy_exit = jpos.arch;
+    emit_vm_exit_syscall_guard();
+
+    // Called from a site stub. The flags the branch saw may still be live.
+    lazy_stub = jpos.arch;
+    emit_pushfq();
+    emit_non_vm_sub_entry_seq_to_host();
+    emit_mov_reg_addr(RSI, RELOC_ENGINE, this);
+    emit_host_call((const void*) jit_lazily_from_stub);
+    emit_non_vm_sub_exit_seq_to_host();
+    emit_popfq();
+    emit_ret();
+    pn0 = jpos.arch;
+
+    jpos.arch = pj0;
+    emit_jmp_imm32(pn0 - pj0);
+    jpos.arch = pn0;
+}
+
+
+void x86_64JIT::emit_call_graph_stubs()
+{
+    if (!(vm_flags & VM_CALL_GRAPH))
+        return;
+
+    uint8_t *pj0, *pn0;
+
+    pj0 = jpos.arch;
+    jpos.arch += sizeof(JMP_IMM32);
+
+    enter_stub = jpos.arch;
+    emit_call_graph_stub((const void*) call_entered_from_stub);
+    leave_stub = jpos.arch;
+    emit_call_graph_stub((const void*) call_left_from_stub);
+    pn0 = jpos.arch;
+
+    jpos.arch = pj0;
+    emit_jmp_imm32(pn0 - pj0);
+    jpos.arch = pn0;
+}
+
+
+void x86_64JIT::emit_call_graph_stub(const void* fn)
+{
+    // The flags the call or ret follows may still be live.
+    emit_pushfq();
+    emit_non_vm_sub_entry_seq_to_host();
+    emit_mov_reg_addr(RSI, RELOC_ENGINE, this);
+    emit_host_call(fn);
+    emit_non_vm_sub_exit_seq_to_host();
+    emit_popfq();
+    emit_ret();
+}
+
+
 void x86_64JIT::emit_vm_reg_save_seq()
 {
-    emit_mov_reg_imm(RBP, (uint64_t) reg_dump_area.get());
+    emit_mov_reg_addr(RBP, RELOC_REGS, reg_dump_area.get());
 
     emit_mov_b32d_reg(RBP, 0x00, as_arch_reg(vm_reg_t::R0) );
     emit_mov_b32d_reg(RBP, 0x08, as_arch_reg(vm_reg_t::R1) );
@@ -471,6 +814,27 @@ void x86_64JIT::emit_vm_reg_save_seq()
 }
 
 
+void x86_64JIT::emit_vm_reg_restore_seq()
+{
+    emit_mov_reg_addr(RBP, RELOC_REGS, reg_dump_area.get());
+
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R0),  RBP, 0x00);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R1),  RBP, 0x08);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R2),  RBP, 0x10);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R3),  RBP, 0x18);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R4),  RBP, 0x20);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R5),  RBP, 0x28);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R6),  RBP, 0x30);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R7),  RBP, 0x38);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R8),  RBP, 0x40);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R9),  RBP, 0x48);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R10), RBP, 0x50);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R11), RBP, 0x58);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::R12), RBP, 0x60);
+    emit_mov_reg_b32d(as_arch_reg(vm_reg_t::SP),  RBP, 0x68);
+}
+
+
 void x86_64JIT::emit_reg_init()
 {
     emit_mov_reg_imm32(as_arch_reg(vm_reg_t::R0),  0);
@@ -487,7 +851,12 @@ void x86_64JIT::emit_reg_init()
     emit_mov_reg_imm32(as_arch_reg(vm_reg_t::R11), 0);
     emit_mov_reg_imm32(as_arch_reg(vm_reg_t::R12), 0);
 
-    emit_mov_reg_imm(as_arch_reg(vm_reg_t::SP),  (uint64_t) stack);
+    emit_mov_reg_addr(as_arch_reg(vm_reg_t::SP), RELOC_DATA, stack);
+
+    if (vm_flags & VM_FUEL) {
+        emit_mov_reg_addr(RBP, RELOC_TEXT, fuel_counter);
+        emit_mov_reg_b8d(FUEL_REG, RBP, 0);
+    }
 }
 
 
@@ -501,8 +870,46 @@ void x86_64JIT::emit_vm_exit_syscall_guard()
 
 void x86_64JIT::emit_add_reg_imm64(arch_reg_t rd, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_add_reg_reg(rd, RBP);
+    if (imm == 1) {
+        emit_inc_reg(rd);
+    } else if (imm == -1) {
+        emit_dec_reg(rd);
+    } else if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_ADD, rd, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_add_reg_reg(rd, RBP);
+    }
+}
+
+
+void x86_64JIT::emit_alu_reg_imm8(arch_alu_op_t op, arch_reg_t rd, int8_t imm)
+{
+    *(jpos.arch++) = *(ALU_R_IMM8 + 0) | rex_adj_m(rd);
+
+    rd = reg_base(rd);
+
+    *(jpos.arch++) = *(ALU_R_IMM8 + 1);
+    *(jpos.arch++) = MOD_R | (op << 3) | rd;
+    *(jpos.arch++) = imm;
+}
+
+
+void x86_64JIT::emit_alu_reg_imm32(arch_alu_op_t op, arch_reg_t rd, int32_t imm)
+{
+    if (is_imm8(imm)) {
+        emit_alu_reg_imm8(op, rd, (int8_t) imm);
+        return;
+    }
+
+    *(jpos.arch++) = *(ALU_R_IMM32 + 0) | rex_adj_m(rd);
+
+    rd = reg_base(rd);
+
+    *(jpos.arch++) = *(ALU_R_IMM32 + 1);
+    *(jpos.arch++) = MOD_R | (op << 3) | rd;
+    *((int32_t*) jpos.arch) = imm;
+    jpos.arch += 4;
 }
 
 
@@ -520,8 +927,12 @@ void x86_64JIT::emit_add_reg_reg(arch_reg_t rd, arch_reg_t rs)
 
 void x86_64JIT::emit_and_reg_imm64(arch_reg_t rd, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_and_reg_reg(rd, RBP);
+    if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_AND, rd, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_and_reg_reg(rd, RBP);
+    }
 }
 
 
@@ -539,8 +950,16 @@ void x86_64JIT::emit_and_reg_reg(arch_reg_t rd, arch_reg_t rs)
 
 void x86_64JIT::emit_cmp_reg_imm64(arch_reg_t rs, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_cmp_reg_reg(rs, RBP);
+    // test leaves ZF and SF as cmp with 0 would and clears OF, which is all
+    // the VM conditional jumps look at.
+    if (imm == 0) {
+        emit_test_reg_reg(rs, rs);
+    } else if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_CMP, rs, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_cmp_reg_reg(rs, RBP);
+    }
 }
 
 
@@ -556,10 +975,36 @@ void x86_64JIT::emit_cmp_reg_reg(arch_reg_t rs1, arch_reg_t rs2)
 }
 
 
+void x86_64JIT::emit_dec_reg(arch_reg_t r)
+{
+    *(jpos.arch++) = *(DEC_R + 0) | rex_adj_m(r);
+
+    r = reg_base(r);
+
+    *(jpos.arch++) = *(DEC_R + 1);
+    *(jpos.arch++) = MOD_R | (0b001 << 3) | r;
+}
+
+
+void x86_64JIT::emit_inc_reg(arch_reg_t r)
+{
+    *(jpos.arch++) = *(INC_R + 0) | rex_adj_m(r);
+
+    r = reg_base(r);
+
+    *(jpos.arch++) = *(INC_R + 1);
+    *(jpos.arch++) = MOD_R | (0b000 << 3) | r;
+}
+
+
 void x86_64JIT::emit_or_reg_imm64(arch_reg_t rd, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_or_reg_reg(rd, RBP);
+    if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_OR, rd, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_or_reg_reg(rd, RBP);
+    }
 }
 
 
@@ -588,8 +1033,16 @@ void x86_64JIT::emit_not_reg(arch_reg_t r)
 
 void x86_64JIT::emit_sub_reg_imm64(arch_reg_t rd, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_sub_reg_reg(rd, RBP);
+    if (imm == 1) {
+        emit_dec_reg(rd);
+    } else if (imm == -1) {
+        emit_inc_reg(rd);
+    } else if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_SUB, rd, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_sub_reg_reg(rd, RBP);
+    }
 }
 
 
@@ -605,10 +1058,26 @@ void x86_64JIT::emit_sub_reg_reg(arch_reg_t rd, arch_reg_t rs)
 }
 
 
+void x86_64JIT::emit_test_reg_reg(arch_reg_t rs1, arch_reg_t rs2)
+{
+    *(jpos.arch++) = *(TEST_R_R + 0) | rex_adj_rm(rs2, rs1);
+
+    rs1 = reg_base(rs1);
+    rs2 = reg_base(rs2);
+
+    *(jpos.arch++) = *(TEST_R_R + 1);
+    *(jpos.arch++) = MOD_R | (rs2 << 3) | rs1;
+}
+
+
 void x86_64JIT::emit_xor_reg_imm64(arch_reg_t rd, int64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_xor_reg_reg(rd, RBP);
+    if (is_imm32(imm)) {
+        emit_alu_reg_imm32(ALU_XOR, rd, (int32_t) imm);
+    } else {
+        emit_mov_reg_imm(RBP, imm);
+        emit_xor_reg_reg(rd, RBP);
+    }
 }
 
 
@@ -692,8 +1161,7 @@ void x86_64JIT::emit_mov_reg_b32d(arch_reg_t rd, arch_reg_t rb, int32_t d)
 
 void x86_64JIT::emit_mov_reg_imm(arch_reg_t rd, int64_t imm)
 {
-    int32_t upper_dword = (imm & 0xffffffff00000000) >> 32;
-    if (upper_dword == 0 || upper_dword == -1) {
+    if (is_imm32(imm)) {
         emit_mov_reg_imm32(rd, (int32_t) imm);
     } else {
         emit_mov_reg_imm64(rd, imm);
@@ -726,6 +1194,14 @@ void x86_64JIT::emit_mov_reg_imm64(arch_reg_t rd, int64_t imm)
 }
 
 
+void x86_64JIT::emit_mov_reg_addr(arch_reg_t rd, reloc_kind_t kind, const void* addr)
+{
+    // Always the long form, so the code can be relocated in place.
+    emit_mov_reg_imm64(rd, (int64_t) addr);
+    record_reloc(kind, jpos.arch - 8, (uint64_t) addr);
+}
+
+
 void x86_64JIT::emit_mov_reg_reg(arch_reg_t rd, arch_reg_t rs)
 {
     *(jpos.arch++) = *(MOV_R_R + 0) | rex_adj_rm(rd, rs);
@@ -738,10 +1214,65 @@ void x86_64JIT::emit_mov_reg_reg(arch_reg_t rd, arch_reg_t rs)
 }
 
 
+void x86_64JIT::emit_mov_reg_ripd(arch_reg_t rd, const void* addr)
+{
+    *(jpos.arch++) = *(MOV_R_RIPD + 0) | rex_adj_r(rd);
+
+    rd = reg_base(rd);
+
+    *(jpos.arch++) = *(MOV_R_RIPD + 1);
+    *(jpos.arch++) = MOD_B0D | (rd << 3) | 0b101;
+    *((int32_t*) jpos.arch) = (int32_t) ((int64_t) addr - (int64_t) (jpos.arch + 4));
+    jpos.arch += 4;
+}
+
+
+void x86_64JIT::emit_mov_ripd_reg(const void* addr, arch_reg_t rs)
+{
+    *(jpos.arch++) = *(MOV_RIPD_R + 0) | rex_adj_r(rs);
+
+    rs = reg_base(rs);
+
+    *(jpos.arch++) = *(MOV_RIPD_R + 1);
+    *(jpos.arch++) = MOD_B0D | (rs << 3) | 0b101;
+    *((int32_t*) jpos.arch) = (int32_t) ((int64_t) addr - (int64_t) (jpos.arch + 4));
+    jpos.arch += 4;
+}
+
+
+void x86_64JIT::emit_lea_reg_b8d(arch_reg_t rd, arch_reg_t rb, int8_t d)
+{
+    *(jpos.arch++) = *(LEA_R_B8D + 0) | rex_adj_rm(rd, rb);
+
+    rd = reg_base(rd);
+    rb = reg_base(rb);
+
+    *(jpos.arch++) = *(LEA_R_B8D + 1);
+    *(jpos.arch++) = MOD_B8D | (rd << 3) | rb;
+    if (rb == RSP || rb == R12) {
+        *(jpos.arch++) = (0b100 << 3) | rb;
+    }
+    *(jpos.arch++) = d;
+}
+
+
 void x86_64JIT::emit_call_imm64(uint64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_call_reg(RBP);
+    int64_t rel = (int64_t) imm - (int64_t) jpos.arch;
+    if (fits_rel32(rel, sizeof(CALL_IMM32))) {
+        emit_call_imm32((int32_t) rel);
+    } else {
+        emit_mov_reg_addr(RBP, RELOC_TEXT, (const void*) imm);
+        emit_call_reg(RBP);
+    }
+}
+
+
+void x86_64JIT::emit_call_imm32(int32_t imm)
+{
+    *(jpos.arch++) = *(CALL_IMM32 + 0);
+    *((int32_t*) jpos.arch) = imm - sizeof(CALL_IMM32);
+    jpos.arch += 4;
 }
 
 
@@ -756,6 +1287,13 @@ void x86_64JIT::emit_call_reg(arch_reg_t rs)
 }
 
 
+void x86_64JIT::emit_je_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JE_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JE_IMM8);
+}
+
+
 void x86_64JIT::emit_je_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JE_IMM32 + 0);
@@ -765,6 +1303,13 @@ void x86_64JIT::emit_je_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jne_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JNE_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JNE_IMM8);
+}
+
+
 void x86_64JIT::emit_jne_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JNE_IMM32 + 0);
@@ -774,6 +1319,13 @@ void x86_64JIT::emit_jne_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jg_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JG_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JG_IMM8);
+}
+
+
 void x86_64JIT::emit_jg_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JG_IMM32 + 0);
@@ -783,6 +1335,13 @@ void x86_64JIT::emit_jg_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jge_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JGE_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JGE_IMM8);
+}
+
+
 void x86_64JIT::emit_jge_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JGE_IMM32 + 0);
@@ -792,6 +1351,13 @@ void x86_64JIT::emit_jge_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jl_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JL_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JL_IMM8);
+}
+
+
 void x86_64JIT::emit_jl_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JL_IMM32 + 0);
@@ -801,6 +1367,13 @@ void x86_64JIT::emit_jl_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jle_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JLE_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JLE_IMM8);
+}
+
+
 void x86_64JIT::emit_jle_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JLE_IMM32 + 0);
@@ -810,6 +1383,20 @@ void x86_64JIT::emit_jle_imm32(int32_t imm)
 }
 
 
+void x86_64JIT::emit_jns_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JNS_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JNS_IMM8);
+}
+
+
+void x86_64JIT::emit_jmp_imm8(int8_t imm)
+{
+    *(jpos.arch++) = *(JMP_IMM8 + 0);
+    *(jpos.arch++) = imm - sizeof(JMP_IMM8);
+}
+
+
 void x86_64JIT::emit_jmp_imm32(int32_t imm)
 {
     *(jpos.arch++) = *(JMP_IMM32 + 0);
@@ -820,8 +1407,15 @@ void x86_64JIT::emit_jmp_imm32(int32_t imm)
 
 void x86_64JIT::emit_jmp_imm64(uint64_t imm)
 {
-    emit_mov_reg_imm(RBP, imm);
-    emit_jmp_reg(RBP);
+    int64_t rel = (int64_t) imm - (int64_t) jpos.arch;
+    if (fits_rel8(rel, sizeof(JMP_IMM8))) {
+        emit_jmp_imm8((int8_t) rel);
+    } else if (fits_rel32(rel, sizeof(JMP_IMM32))) {
+        emit_jmp_imm32((int32_t) rel);
+    } else {
+        emit_mov_reg_addr(RBP, RELOC_TEXT, (const void*) imm);
+        emit_jmp_reg(RBP);
+    }
 }
 
 
@@ -854,6 +1448,12 @@ void x86_64JIT::emit_pop_reg(arch_reg_t rd)
 }
 
 
+void x86_64JIT::emit_popfq()
+{
+    *(jpos.arch++) = *(POPFQ + 0);
+}
+
+
 void x86_64JIT::emit_push_reg(arch_reg_t rs)
 {
     if (reg_base(rs) != rs) {
@@ -866,6 +1466,12 @@ void x86_64JIT::emit_push_reg(arch_reg_t rs)
 }
 
 
+void x86_64JIT::emit_pushfq()
+{
+    *(jpos.arch++) = *(PUSHFQ + 0);
+}
+
+
 void x86_64JIT::emit_ret()
 {
     *(jpos.arch++) = *(RET + 0);
@@ -874,11 +1480,55 @@ void x86_64JIT::emit_ret()
 
 void x86_64JIT::emit_sys_enter_call()
 {
-    emit_mov_reg_imm(RBP, (uint64_t) &vm_sp);
+    emit_host_call((const void*) sys_enter);
+}
+
+
+void x86_64JIT::emit_host_call(const void* fn)
+{
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &vm_sp);
     emit_mov_reg_b8d(RDI, RBP, 0);
 
-    emit_call_imm64((uint64_t) sys_enter);
+    // The VM stack carries no alignment guarantee; the host ABI wants 16.
+    // RBP is callee-saved, so it keeps the VM stack pointer across the call.
+    emit_mov_reg_reg(RBP, RSP);
+    emit_alu_reg_imm8(ALU_AND, RSP, -16);
+    emit_mov_reg_addr(RAX, RELOC_HOST_CODE, fn);
+    emit_call_reg(RAX);
+    emit_mov_reg_reg(RSP, RBP);
 
-    emit_mov_reg_imm(RBP, (uint64_t) &vm_sp);
+    emit_mov_reg_addr(RBP, RELOC_ENGINE, &vm_sp);
     emit_mov_b8d_reg(RBP, 0, RAX);
 }
+
+
+void x86_64JIT::emit_block_count(uint64_t vm_addr)
+{
+    uint64_t* counter = block_counter(vm_addr);
+    if (counter == nullptr)
+        return;
+
+    // Block entries may sit between a cmp and its jump, so leave RFLAGS alone.
+    if ((uint8_t*) counter - jpos.arch > INT32_MAX)
+        ABORT("Block counter out of rel32 reach; use less VM memory." << endl);
+    emit_mov_reg_ripd(RBP, counter);
+    emit_lea_reg_b8d(RBP, RBP, 1);
+    emit_mov_ripd_reg(counter, RBP);
+}
+
+
+void x86_64JIT::emit_fuel_check(uint64_t vm_addr)
+{
+    if (!needs_fuel_check(vm_addr))
+        return;
+
+    // Running dry yields with the flags still on the VM stack.
+    bool save_flags = flags_live_at(vm_addr);
+    if (save_flags)
+        emit_pushfq();
+    emit_alu_reg_imm8(ALU_SUB, FUEL_REG, 1);
+    emit_jns_imm8(sizeof(JNS_IMM8) + sizeof(CALL_IMM32));
+    emit_call_imm32(yield_stub - jpos.arch);
+    if (save_flags)
+        emit_popfq();
+}
@@ -2,13 +2,14 @@
 
 
 #include <map>
+#include <vector>
 
 #include "jit.h"
 
 
 class x86_64JIT final : public JIT {
 public:
-    x86_64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, bool debug);
+    x86_64JIT(const void* prog, size_t prog_size, size_t mem_size_mb, uint32_t vm_flags, bool debug);
 
 private:
     static constexpr const char* OBJDUMP_FMT        = "objdump -b binary -m i386:x86-64 -M intel --adjust-vma 0x%llx -D %s > %s";
@@ -17,6 +18,31 @@ private:
     uint64_t                                        host_sp;
     uint64_t                                        vm_sp;
 
+    // With lazy compilation: the stub that compiles a branch target on first
+    // entry, the exit for code that runs off the end of the program, and the
+    // branches compiled to a stub of their own, indexed from the stub.
+    uint8_t                                         *lazy_stub;
+    uint8_t                                         *lazy_exit;
+    std::vector<fixup_t>                            lazy_sites;
+
+    // With VM_CALL_GRAPH, the stubs code calls right before a call, with the
+    // VM address called after the call to the stub, and right before a ret.
+    uint8_t                                         *enter_stub;
+    uint8_t                                         *leave_stub;
+
+    /* Parallel compilation, see jit_in_parallel(). Below PARALLEL_MIN_INSTRS
+     * threads cost more than they save. MAX_INSTR_CODE bounds the code for a
+     * VM instruction, with what may close the run after it.
+     */
+    static constexpr size_t PARALLEL_MIN_INSTRS     = 16384;
+    static constexpr size_t MAX_JIT_THREADS         = 16;
+    static constexpr size_t MAX_INSTR_CODE          = 128;
+
+    // The code size of each run, from a first parallel pass.
+    std::vector<uint64_t>                           run_sizes;
+
+    explicit x86_64JIT(x86_64JIT* owner);
+
     void jit() override;
 
     typedef enum : uint8_t {
@@ -39,8 +65,16 @@ private:
     } arch_reg_t;
     static constexpr uint8_t ARCH_REG_MASK          = 0b00000111;
 
+    // Not a VM register; holds the fuel left with VM_FUEL.
+    static constexpr arch_reg_t FUEL_REG            = RDI;
+
     static const std::map<vm_reg_t, arch_reg_t> vr2ar;
 
+    typedef enum : uint8_t {
+        FIXUP_REL8                                  = 0,    // rel8 displacement ending the instruction
+        FIXUP_REL32                                 = 1,    // rel32 displacement ending the instruction
+    } fixup_kind_t;
+
     typedef enum : uint8_t {
         REX_W                                       = 0b01001000,
         REX_R                                       = 0b01000100,
@@ -55,9 +89,32 @@ private:
         MOD_R                                       = 0b11000000,
     } arch_mod_t;
 
+    // The /x opcode extension of the 81 and 83 immediate ALU forms.
+    typedef enum : uint8_t {
+        ALU_ADD                                     = 0b000,
+        ALU_OR                                      = 0b001,
+        ALU_AND                                     = 0b100,
+        ALU_SUB                                     = 0b101,
+        ALU_XOR                                     = 0b110,
+        ALU_CMP                                     = 0b111,
+    } arch_alu_op_t;
+
     void jit_program();
-    void jit_vm_instruction();
-    void jit_deferred();
+    size_t jit_threads() const;
+    bool jit_in_parallel(size_t num_runs);
+    bool jit_run(const ir_instr_t* first, const ir_instr_t* last, uint8_t* limit, bool check);
+    uint64_t jit_lazily(uint64_t vm_addr);
+    static uint64_t* jit_lazily_from_stub(uint64_t* sp, x86_64JIT* jit);
+    static uint64_t* call_entered_from_stub(uint64_t* sp, x86_64JIT* jit);
+    static uint64_t* call_left_from_stub(uint64_t* sp, x86_64JIT* jit);
+    void jit_vm_instruction(const ir_instr_t& ins);
+    void patch_fixup(const fixup_t& fixup, const uint8_t* target) override;
+    bool fits_short_branch(int64_t rel) const override
+                                                    { return fits_rel8(rel, 0); }
+    const uint64_t* sampled_vm_sp(const void* ctx, bool in_code) const override;
+
+    bool clobbers_flags(const ir_instr_t& ins) const override
+                                                    { return ins.op >= ADD && ins.op <= XOR; }
 
     void emit_vm_sub_entry_seq_from_host();
     void emit_vm_sub_exit_seq_to_host();
@@ -65,13 +122,27 @@ private:
     void emit_non_vm_sub_exit_seq_to_host();
 
     void emit_sys_enter_stub();
+    void emit_fuel_stubs();
+    void emit_tier_entry_stub();
+    void emit_ret_pads();
+    void emit_lazy_stubs();
+    void emit_call_graph_stubs();
+    void emit_call_graph_stub(const void* fn);
     void emit_vm_reg_save_seq();
+    void emit_vm_reg_restore_seq();
     void emit_reg_init();
     void emit_vm_exit_syscall_guard();
 
     arch_reg_t as_arch_reg(vm_reg_t reg) const      { return vr2ar.at(reg); }
     arch_reg_t as_arch_reg(uint8_t byte) const      { return as_arch_reg(static_cast<vm_reg_t>(byte)); }
 
+    static bool is_imm8(int64_t imm)                { return imm == (int8_t) imm; }
+    static bool is_imm32(int64_t imm)               { return imm == (int32_t) imm; }
+
+    // Whether a branch of size len at jpos.arch can reach jpos.arch + rel.
+    static bool fits_rel8(int64_t rel, size_t len)  { return is_imm8(rel - (int64_t) len); }
+    static bool fits_rel32(int64_t rel, size_t len) { return is_imm32(rel - (int64_t) len); }
+
     static arch_reg_t reg_base(arch_reg_t r)        { return static_cast<arch_reg_t>(r & ARCH_REG_MASK); }
     static arch_rex_prefix_t rex_adj_r(arch_reg_t r)
                                                     {
@@ -93,43 +164,67 @@ private:
                                                     }
 
     static constexpr uint8_t ADD_R_R[]              = { REX_W, 0x03, 0x00                                           };
+    static constexpr uint8_t ALU_R_IMM8[]           = { REX_W, 0x83, 0x00, 0x00                                     };
+    static constexpr uint8_t ALU_R_IMM32[]          = { REX_W, 0x81, 0x00, 0x00, 0x00, 0x00, 0x00                   };
     static constexpr uint8_t AND_R_R[]              = { REX_W, 0x23, 0x00                                           };
+    static constexpr uint8_t CALL_IMM32[]           = { 0xe8,  0x00, 0x00, 0x00, 0x00                               };
     static constexpr uint8_t CALL_R[]               = { REX_W, 0xff, 0x00                                           };
     static constexpr uint8_t CMP_R_R[]              = { REX_W, 0x39, 0x00                                           };
+    static constexpr uint8_t DEC_R[]                = { REX_W, 0xff, 0x00                                           };
+    static constexpr uint8_t INC_R[]                = { REX_W, 0xff, 0x00                                           };
+    static constexpr uint8_t JE_IMM8[]              = { 0x74,  0x00                                                 };
     static constexpr uint8_t JE_IMM32[]             = { 0x0f,  0x84, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JNE_IMM8[]             = { 0x75,  0x00                                                 };
     static constexpr uint8_t JNE_IMM32[]            = { 0x0f,  0x85, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JG_IMM8[]              = { 0x7f,  0x00                                                 };
     static constexpr uint8_t JG_IMM32[]             = { 0x0f,  0x8f, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JGE_IMM8[]             = { 0x7d,  0x00                                                 };
     static constexpr uint8_t JGE_IMM32[]            = { 0x0f,  0x8d, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JL_IMM8[]              = { 0x7c,  0x00                                                 };
     static constexpr uint8_t JL_IMM32[]             = { 0x0f,  0x8c, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JLE_IMM8[]             = { 0x7e,  0x00                                                 };
     static constexpr uint8_t JLE_IMM32[]            = { 0x0f,  0x8e, 0x00, 0x00, 0x00, 0x00                         };
+    static constexpr uint8_t JNS_IMM8[]             = { 0x79,  0x00                                                 };
+    static constexpr uint8_t JMP_IMM8[]             = { 0xeb,  0x00                                                 };
     static constexpr uint8_t JMP_IMM32[]            = { 0xe9,  0x00, 0x00, 0x00, 0x00                               };
     static constexpr uint8_t JMP_R[]                = { REX_W, 0xff, 0x00                                           };
+    static constexpr uint8_t LEA_R_B8D[]            = { REX_W, 0x8d, 0x00, 0x00, 0x00                               };
     static constexpr uint8_t MOV_BD_R[]             = { REX_W, 0x89, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00             };
     static constexpr uint8_t MOV_R_BD[]             = { REX_W, 0x8b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00             };
     static constexpr uint8_t MOV_R_IMM32[]          = { REX_W, 0xc7, 0x00, 0x00, 0x00, 0x00, 0x00                   };
     static constexpr uint8_t MOV_R_IMM64[]          = { REX_W, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
     static constexpr uint8_t MOV_R_R[]              = { REX_W, 0x8b, 0x00                                           };
+    static constexpr uint8_t MOV_R_RIPD[]           = { REX_W, 0x8b, 0x00, 0x00, 0x00, 0x00, 0x00                   };
+    static constexpr uint8_t MOV_RIPD_R[]           = { REX_W, 0x89, 0x00, 0x00, 0x00, 0x00, 0x00                   };
     static constexpr uint8_t NOP[]                  = { 0x90                                                        };
     static constexpr uint8_t NOT_R[]                = { REX_W, 0xf7, 0x00                                           };
     static constexpr uint8_t OR_R_R[]               = { REX_W, 0x0b, 0x00                                           };
     static constexpr uint8_t POP_REG[]              = { REX_B, 0x58                                                 };
+    static constexpr uint8_t POPFQ[]                = { 0x9d                                                        };
     static constexpr uint8_t PUSH_REG[]             = { REX_B, 0x50                                                 };
+    static constexpr uint8_t PUSHFQ[]               = { 0x9c                                                        };
     static constexpr uint8_t RET[]                  = { 0xc3                                                        };
     static constexpr uint8_t SUB_R_R[]              = { REX_W, 0x2b, 0x00                                           };
+    static constexpr uint8_t TEST_R_R[]             = { REX_W, 0x85, 0x00                                           };
     static constexpr uint8_t XOR_R_R[]              = { REX_W, 0x33, 0x00                                           };
 
     // Data processing
     void emit_add_reg_imm64(arch_reg_t rd, int64_t imm);
+    void emit_alu_reg_imm8(arch_alu_op_t op, arch_reg_t rd, int8_t imm);
+    void emit_alu_reg_imm32(arch_alu_op_t op, arch_reg_t rd, int32_t imm);
     void emit_add_reg_reg(arch_reg_t rd, arch_reg_t rs);
     void emit_and_reg_imm64(arch_reg_t rd, int64_t imm);
     void emit_and_reg_reg(arch_reg_t rd, arch_reg_t rs);
     void emit_cmp_reg_imm64(arch_reg_t rs, int64_t imm);
     void emit_cmp_reg_reg(arch_reg_t rs1, arch_reg_t rs2);
+    void emit_dec_reg(arch_reg_t r);
+    void emit_inc_reg(arch_reg_t r);
     void emit_or_reg_imm64(arch_reg_t rd, int64_t imm);
     void emit_or_reg_reg(arch_reg_t rd, arch_reg_t rs);
     void emit_not_reg(arch_reg_t r);
     void emit_sub_reg_imm64(arch_reg_t rd, int64_t imm);
     void emit_sub_reg_reg(arch_reg_t rd, arch_reg_t rs);
+    void emit_test_reg_reg(arch_reg_t rs1, arch_reg_t rs2);
     void emit_xor_reg_imm64(arch_reg_t rd, int64_t imm);
     void emit_xor_reg_reg(arch_reg_t rd, arch_reg_t rs);
 
@@ -141,17 +236,30 @@ private:
     void emit_mov_reg_imm(arch_reg_t rd, int64_t imm);
     void emit_mov_reg_imm32(arch_reg_t rd, int32_t imm);
     void emit_mov_reg_imm64(arch_reg_t rd, int64_t imm);
+    void emit_mov_reg_addr(arch_reg_t rd, reloc_kind_t kind, const void* addr);
     void emit_mov_reg_reg(arch_reg_t rd, arch_reg_t rs);
+    void emit_mov_reg_ripd(arch_reg_t rd, const void* addr);
+    void emit_mov_ripd_reg(const void* addr, arch_reg_t rs);
+    void emit_lea_reg_b8d(arch_reg_t rd, arch_reg_t rb, int8_t d);
 
     // Branch
     void emit_call_imm64(uint64_t imm);
+    void emit_call_imm32(int32_t imm);
     void emit_call_reg(arch_reg_t rs);
+    void emit_je_imm8(int8_t imm);
     void emit_je_imm32(int32_t imm);
+    void emit_jne_imm8(int8_t imm);
     void emit_jne_imm32(int32_t imm);
+    void emit_jg_imm8(int8_t imm);
     void emit_jg_imm32(int32_t imm);
+    void emit_jge_imm8(int8_t imm);
     void emit_jge_imm32(int32_t imm);
+    void emit_jl_imm8(int8_t imm);
     void emit_jl_imm32(int32_t imm);
+    void emit_jle_imm8(int8_t imm);
     void emit_jle_imm32(int32_t imm);
+    void emit_jns_imm8(int8_t imm);
+    void emit_jmp_imm8(int8_t imm);
     void emit_jmp_imm32(int32_t imm);
     void emit_jmp_imm64(uint64_t imm);
     void emit_jmp_reg(arch_reg_t rs);
@@ -159,8 +267,13 @@ private:
 
     // Other
     void emit_pop_reg(arch_reg_t rd);
+    void emit_popfq();
     void emit_push_reg(arch_reg_t rs);
+    void emit_pushfq();
     void emit_ret();
 
     void emit_sys_enter_call();
+    void emit_host_call(const void* fn);
+    void emit_block_count(uint64_t vm_addr);
+    void emit_fuel_check(uint64_t vm_addr);
 };